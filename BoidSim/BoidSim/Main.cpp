@@ -11,6 +11,18 @@
 #include "obstacleplane.h"
 #include "levelfactory.h"
 #include "spatial_hash.hpp"
+#include "flock.hpp"
+#include "distance_field.hpp"
+#include "obstacle_index.hpp"
+#include "obstacle_mesh.hpp"
+#include "flow_field.hpp"
+#include "wind_field.hpp"
+#include "sim_clock.hpp"
+#include "integrator.hpp"
+#include "sim_lod.hpp"
+#include "boid_sleep.hpp"
+#include "parallel.hpp"
+#include "fast_math.hpp"
 #include <algorithm>
 
 #include "imgui/imgui.h"
@@ -22,16 +34,18 @@
 #include <iostream>
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
-void processInput(GLFWwindow *window);
+void processInput(GLFWwindow *window, float seconds);
 double xpos, ypos; // cursor position
 
 // setup
 const unsigned int screenWidth = 1280, screenHeight = 720;
 
 // camera settings
+const float FIELD_OF_VIEW = 45.0f; // vertical, degrees
 glm::vec3 cameraDir(1.0f, 1.0f, 200.0f);
 glm::vec3 cameraPos(1.0f, 1.0f, -200.0f);
 double yaw = 1.6f, pitch = 0.0f;
+const float CAMERA_SPEED = 3.0f / TIME_UNIT; // per second
 
 // How many boids on screen
 const int nrBoids = 10;
@@ -43,11 +57,13 @@ const int level = 1;
 std::vector<Boid> boids;
 std::vector<ObstaclePlane> walls;
 std::vector<ObstaclePoint> objects;
+std::vector<Goal> goals;
 
-// Boid attributes
-const float MAX_SPEED = 0.3f;
-const float MAX_ACCELERATION = 0.05f;
-const float SOFTNESS = 10.0f;
+// Fixed step simulation, positions after the second to last step are kept to draw the boids in between
+SimulationClock simClock;
+std::vector<glm::vec3> previousPositions;
+
+// Boid attributes (the rest are in flock.cpp)
 bool repellLine = false;
 
 // Vertex Array Object, Vertex/Element Buffer Objects, texture (can be reused)
@@ -58,76 +74,11 @@ bool show_demo_window = true;
 bool show_another_window = false;
 ImVec4 clear_color = ImVec4(0.45f, 0.55f, 0.60f, 1.00f);
 
-// If e.g. percentage = 1 => vec3(0,0,0) will be returned with 99% probability
-glm::vec3 getRandomVectorWithChance(int percentage) {
-	bool maybe = percentage == 0 ? false : rand() % (100/percentage) == 0;
-	return glm::vec3(maybe ? rand() % 121 - 60, rand() % 121 - 60, rand() % 21 - 10 : 0, 0, 0);
-}
-
 // If e.g rangePercent is 5 then this will return a number between 0.95 and 1.05
 float getRandomFloatAroundOne(int rangePercent) {
 	return 1.0f + ((rand() % 1001 - 500) % (rangePercent * 10)) / 1000.0f;
 }
 
-glm::vec3 getSteering(Boid & b) { // Flocking rules are implemented here
-
-	glm::vec3 alignment = glm::vec3(0.0);
-	glm::vec3 separation = glm::vec3(0.0);
-	glm::vec3 cohesion = glm::vec3(0.0);
-	glm::vec3 lineforce = glm::vec3(0.0);
-	glm::vec3 planeforce = glm::vec3(0.0);
-	glm::vec3 pointforce = glm::vec3(0.0);
-	std::vector<Boid*> nb = getNeighbours(b);
-
-	//Flocking rules
-	for (Boid* n : nb) {
-		Boid neighbour = *n;
-		alignment += neighbour.velocity;
-		cohesion += neighbour.position;
-		//separation += normalize(b.position - neighbour.position) * SOFTNESS / (pow(distance(b.position, neighbour.position),2) + 0.0001); // + 0.0001 is for avoiding divide by zero
-		separation += normalize(b.position - neighbour.position) / distance(b.position, neighbour.position);
-	}
-
-	if (std::size(nb) > 0) {
-		alignment = normalize(alignment * (1.0f / std::size(nb)) - b.velocity);
-		cohesion = normalize(cohesion * (1.0f / std::size(nb)) - b.position - b.velocity);
-		separation = normalize(separation * (1.0f / std::size(nb)) - b.velocity);
-	}
-
-	//Avoid planes
-	for (ObstaclePlane o : walls) {
-		glm::vec3 v = b.position - o.point;
-		float distance = SOFTNESS / glm::dot(v, o.normal);
-		planeforce += normalize(o.normal)*distance - b.velocity;
-	}
-
-	//Avoid/steer towards an obstaclepoint
-	for (ObstaclePoint f : objects) {
-		if (f.attractive) {
-			pointforce -= normalize(b.position - f.position) / distance(b.position, f.position);
-		}
-		else {
-			pointforce += normalize(b.position - f.position) / distance(b.position, f.position);
-		}
-	}
-	if (std::size(objects) > 0) {
-		pointforce = normalize(pointforce * (1.0f / std::size(objects)) - b.velocity);
-	}
-
-	//Avoid player controlled line
-	if (repellLine) {
-		glm::vec3 point = cameraPos + dot(b.position - cameraPos, cameraDir) / dot(cameraDir, cameraDir) * (cameraDir);
-		lineforce = normalize(b.position - point) * pow(SOFTNESS,2) / (distance(b.position, point)) - b.velocity;
-	}
-
-	glm::vec3 steering = alignment + cohesion + 2.0f*separation + 10.0f*planeforce + 10.0f*pointforce + lineforce;
-	
-	// Limit acceleration
-	float magnitude = glm::clamp(glm::length(steering), 0.0f, MAX_ACCELERATION); 
-	return magnitude*glm::normalize(steering);
-
-}
-
 unsigned int loadCubemap(std::vector<std::string> faces)
 {
 	unsigned int textureID;
@@ -291,6 +242,42 @@ void createImGuiWindow()
 	ImGui::Checkbox("Another Window", &show_another_window);
 
 	ImGui::SliderFloat("float", &f, 0.0f, 1.0f);            // Edit 1 float using a slider from 0.0f to 1.0f
+	ImGui::Checkbox("Far field", &useFarField);             // Let boids see further through cell aggregates
+	ImGui::SliderFloat("Field of view", &fieldOfView, 0.0f, 360.0f); // Degrees around a boid that it can see in
+	ImGui::SliderInt("Max neighbours", &maxNeighbours, 0, 100);       // 0 means no limit
+	ImGui::Checkbox("Closest neighbours", &closestNeighbours);       // Otherwise the first ones found
+	ImGui::Text("Neighbour queries cut: %u of %u", neighbourStats.truncated, neighbourStats.queries);
+	ImGui::SliderFloat("Point opening angle", &pointOpeningAngle, 0.0f, 1.5f); // Far groups of attractors act as one
+	ImGui::Text("Point force error < %g", pointForceError.load());
+	ImGui::SliderInt("Steps per second", &simRate, 20, 240);
+	ImGui::Combo("Integrator", &integrator, integratorNames, NR_INTEGRATORS);
+	ImGui::Checkbox("Adaptive substeps", &adaptiveSubsteps);
+	ImGui::SliderFloat("Substep tolerance", &substepTolerance, 0.1f, 2.0f); // steering change per step, in max accelerations
+	ImGui::SliderFloat("Stiff distance", &stiffDistance, 0.0f, 100.0f); // boids closer to a wall or the line are tried for substeps
+	ImGui::Text("Substepped boids: %u of %u, %u substeps", integratorStats.substepped, integratorStats.boids, integratorStats.substeps);
+	ImGui::Checkbox("Simulation LOD", &useSimLod);                   // Steer far away boids less often
+	ImGui::SliderFloat("LOD distance", &lodDistance, 20.0f, 500.0f);
+	ImGui::Text("Steered boids: %u, flying straight: %u", lodStats.steered, lodStats.extrapolated);
+	ImGui::Checkbox("Sleeping boids", &useSleep);                     // Boids alone in open space fly straight without steering
+	ImGui::Text("Asleep: %u (%u fell asleep, %u woke up)", sleepStats.asleep, sleepStats.fellAsleep, sleepStats.woken);
+	ImGui::SliderInt("Steering threads", &steerThreads, 1, MAX_THREADS);
+	ImGui::Checkbox("Deterministic", &deterministicMode);             // Neighbours added up in order of boid index, cells not autotuned
+	glm::vec3 centre = getFlockCentre();
+	ImGui::Text("Flock centre %.3f %.3f %.3f, checksum %016llx", centre.x, centre.y, centre.z, (unsigned long long)getFlockChecksum());
+	bool mathChanged = ImGui::Checkbox("Fast math", &fastMath);       // Estimated square roots in the steering
+	mathChanged |= ImGui::Checkbox("Newton step", &newtonRefine);
+	if (mathChanged)
+		measureMathError();
+	ImGui::Text("Max error: 1/sqrt %.2g (relative), normalize %.2g", mathError.inverseSqrt, mathError.normalize);
+	ImGui::Checkbox("Wind", &useWind);
+	ImGui::SliderFloat("Wind strength", &windStrength, 0.0f, 0.1f);
+	float scope = boidScope;
+	if (ImGui::SliderFloat("Boid scope", &scope, 2.0f, 30.0f))  // Safe here, the hash table is empty
+		setGridParameters(scope, cellDivisions);
+	ImGui::Checkbox("Autotune cells", &autotuneCells);
+	ImGui::Text("Cell size %.2f (scope/%d)", cellSize, cellDivisions);
+	for (int d = 1; d <= MAX_CELL_DIVISIONS; d++)
+		ImGui::Text("  scope/%d: %.3f ms, %.1f candidates/query, %.0f%% hits", d, cellSizeTrials[d].seconds * 1000.0, cellSizeTrials[d].candidatesPerQuery, cellSizeTrials[d].hitRate * 100.0f);
 	ImGui::ColorEdit3("clear color", (float*)&clear_color); // Edit 3 floats representing a color
 
 	if (ImGui::Button("Button"))                            // Buttons return true when clicked (most widgets return true when edited/activated)
@@ -302,6 +289,48 @@ void createImGuiWindow()
 	ImGui::End();
 }
 
+// One fixed step of the whole simulation
+void stepSimulation(std::vector<glm::vec3>& steering, std::vector<FlockSums>& sums, std::vector<glm::vec3>& wind)
+{
+	const float dt = getStepLength();
+	// Put all boids in the hash table so we can use it in the next loop
+	// the cell size is tuned on the time spent on the hash table and steering only
+	double gridStart = glfwGetTime();
+	for (uint32_t i = 0; i < boids.size(); i++){
+		putInHashTable(i);
+	}
+	packHashTable();
+	double gridSeconds = glfwGetTime() - gridStart;
+	moveObstacles(objects, ROOM_SIZE / 2, dt);
+	updateFlowField(goals, dt);
+	// far away boids are only steered now and then, the cone of view just holds the corners of the screen
+	float aspect = (float)screenWidth / screenHeight;
+	updateLod(cameraPos, cameraDir, cos(atan(tan(glm::radians(FIELD_OF_VIEW / 2)) * sqrt(1.0f + aspect * aspect))));
+	updateSleep(steering);
+	wind.clear();
+	if (useWind) {
+		updateWind(dt);
+		sampleWind(wind);
+	}
+	// the integrator only needs the neighbour sums if it steers again during the step
+	bool keepSums = integrator != SEMI_IMPLICIT_EULER || adaptiveSubsteps;
+	double steerStart = glfwGetTime();
+	steerFlock(steering, keepSums ? &sums : nullptr, dt, wind);
+	gridSeconds += glfwGetTime() - steerStart;
+	if (!keepSums)
+		sums.clear();
+
+	// Calculate new velocities for each boid, update pos given velocity
+	previousPositions.resize(boids.size());
+	for (uint32_t i = 0; i < boids.size(); i++)
+		previousPositions[i] = boids[i].position;
+	integrateFlock(steering, sums, wind, dt);
+
+	double clearStart = glfwGetTime();
+	clearHashTable();
+	autotuneCellSize(gridSeconds + glfwGetTime() - clearStart);
+}
+
 int main()
 {
 	// glfw: initialize and configure
@@ -390,10 +419,21 @@ int main()
 	};
 
 
+	measureMathError();
+
 	//Initialise boids, walls, objects
+	periodicWorld = getLevelPeriodic(level);
+	setGridParameters(boidScope, cellDivisions);
 	boids = getLevelBoids(level, nrBoids);
+	boidParameters.reset();
+	setLevelParameters(level, boidParameters);
 	walls = getLevelWalls(level);
+	bakeDistanceField(walls, 10.0f);
+	loadObstacleMesh(getLevelMesh(level));
+	goals = getLevelGoals(level);
+	buildFlowField(goals, ROOM_SIZE / 2, 10.0f);
 	objects = getLevelObjects(level);
+	indexObstacles(objects);
 
 	// one vector for each vertex
 	glm::vec3 p1(-1.0f, -1.0f, 0.0f);
@@ -434,7 +474,7 @@ int main()
 	// instantiate transformation matrices
 	glm::mat4 projection, view, model;
 	// projection will always be the same: define FOV, aspect ratio and view frustum (near & far plane)
-	projection = glm::perspective(glm::radians(45.0f), (float)screenWidth / screenHeight, 0.1f, 1000.0f);
+	projection = glm::perspective(glm::radians(FIELD_OF_VIEW), (float)screenWidth / screenHeight, 0.1f, 1000.0f);
 	// set projection matrix as uniform (attach to bound shader)
 	shader.setMatrix("projection", projection);
 
@@ -444,6 +484,9 @@ int main()
 
 	// instantiate array for boids
 	glm::vec3 renderBoids[nrBoids*3*2]; // Each boid has three points and RGB color
+	std::vector<glm::vec3> steering; // new acceleration of each boid
+	std::vector<FlockSums> sums; // what the steering was computed from
+	std::vector<glm::vec3> wind; // pushing each boid
 
 	// Dear ImGui setup
 	ImGui::CreateContext();
@@ -453,12 +496,17 @@ int main()
 
 	// render loop
 	// -----------
+	double lastFrame = glfwGetTime();
 	while (!glfwWindowShouldClose(window))
 	{
+		double now = glfwGetTime();
+		double frameSeconds = now - lastFrame;
+		lastFrame = now;
+
 		// Need to choose shader since we now have 2
 		shader.use();
 		// if got input, processed here
-		processInput(window);
+		processInput(window, (float)frameSeconds);
 
 		// Setup frame for ImGui
 		ImGui_ImplOpenGL3_NewFrame();
@@ -475,36 +523,36 @@ int main()
 		glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-		// Put all boids in the hash table so we can use it in the next loop
-		for (Boid& b : boids){
-			putInHashTable(b);
+		// Catch up with the time this frame covers
+		int steps = simClock.advance(frameSeconds);
+		for (int s = 0; s < steps; s++) {
+			stepSimulation(steering, sums, wind);
 		}
+		float alpha = simClock.alpha();
 
 		for (int i = 0; i < nrBoids; i++)
 			{
-				// Calculate new velocities for each boid, update pos given velocity
-				boids[i].velocity += getSteering(boids.at(i));
-				boids[i].velocity = normalize(boids[i].velocity)*MAX_SPEED;
-				boids[i].position += boids[i].velocity; 
+				// Draw the boid between its last two steps, across the seam if it just wrapped around
+				glm::vec3 position = previousPositions.empty() ? boids[i].position
+					: wrapPosition(previousPositions[i] + alpha * wrapOffset(boids[i].position - previousPositions[i]));
 
 				// create model matrix from agent position
 				glm::mat4 model = glm::mat4(1.0f);
-				model = glm::translate(model, boids[i].position);
+				model = glm::translate(model, position);
 				glm::vec3 v = glm::vec3(boids[i].velocity.z, 0, -boids[i].velocity.x);
 				float angle = acos(boids[i].velocity.y / glm::length(boids[i].velocity));
 				model = glm::rotate(model, angle, v);
 
 				// transform each vertex and add them to array
 				renderBoids[i*6] = view * model * glm::vec4(p1, 1.0f);
-				renderBoids[i*6 + 1] = glm::vec3(0.0f, 1.0f, 0.0f); // color vertex 1
+				bool predator = boids[i].species == PREDATOR; // all red
+				renderBoids[i*6 + 1] = predator ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f); // color vertex 1
 				renderBoids[i*6 + 2] = view * model * glm::vec4(p2, 1.0f);
 				renderBoids[i*6 + 3] = glm::vec3(1.0f, 0.0f, 0.0f); // color vertex 2
 				renderBoids[i*6 + 4] = view * model * glm::vec4(p3, 1.0f);
-				renderBoids[i*6 + 5] = glm::vec3(0.0f, 0.0f, 1.0f); // color vertex 3
+				renderBoids[i*6 + 5] = predator ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 0.0f, 1.0f); // color vertex 3
 			}
 
-		clearHashTable();
-
 		// draw skybox
 		glDepthFunc(GL_LEQUAL);
 		skybox.use();
@@ -565,9 +613,12 @@ int main()
 	return 0;
 }
 
-// process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
-void processInput(GLFWwindow *window)
+// process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly.
+// The camera moves as far as it does in the given seconds, so its speed does not depend on the frame rate
+void processInput(GLFWwindow *window, float seconds)
 {
+	float step = CAMERA_SPEED * seconds;
+
 	double xpos_old = xpos;
 	double ypos_old = ypos;
 	glfwGetCursorPos(window, &xpos, &ypos);
@@ -587,19 +638,19 @@ void processInput(GLFWwindow *window)
 
 	state = glfwGetKey(window, GLFW_KEY_W);
 	if (state == GLFW_PRESS) {
-		cameraPos += cameraDir * 3.0f;
+		cameraPos += cameraDir * step;
 	}
 	state = glfwGetKey(window, GLFW_KEY_S);
 	if (state == GLFW_PRESS) {
-		cameraPos -= cameraDir * 3.0f;
+		cameraPos -= cameraDir * step;
 	}
 	state = glfwGetKey(window, GLFW_KEY_A);
 	if (state == GLFW_PRESS) {
-		cameraPos -= cross(cameraDir, glm::vec3(0.0f, 1.0f, 0.0f)) * 3.0f;
+		cameraPos -= cross(cameraDir, glm::vec3(0.0f, 1.0f, 0.0f)) * step;
 	}
 	state = glfwGetKey(window, GLFW_KEY_D);
 	if (state == GLFW_PRESS) {
-		cameraPos += cross(cameraDir, glm::vec3(0.0f, 1.0f, 0.0f)) * 3.0f;
+		cameraPos += cross(cameraDir, glm::vec3(0.0f, 1.0f, 0.0f)) * step;
 	}
 
 	if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
@@ -4,17 +4,21 @@
 #include <glm/glm.hpp>
 #include <vector>
 
+// Kinds of boids, each with its own parameters (see flock.hpp). The boids of a species are kept together in the boids vector
+enum Species { PREY, PREDATOR, NR_SPECIES };
+
 struct Boid {
 	glm::vec3 position, velocity;
+	int species;
 
 	Boid()
-		: position(rand() % 161 - 80, rand() % 161 - 80, rand() % 81 - 40 ), velocity(rand() % 161 - 80, rand() % 161 - 80, rand() % 81 - 40) { }
+		: position(rand() % 161 - 80, rand() % 161 - 80, rand() % 81 - 40 ), velocity(rand() % 161 - 80, rand() % 161 - 80, rand() % 81 - 40), species(PREY) { }
 
 	Boid(int size)
-		: position(rand() % size - size/2, rand() % size - size/2, rand() % size - size/2), velocity(rand() % size - size / 2, rand() % size - size / 2, rand() % size - size / 2) { }
+		: position(rand() % size - size/2, rand() % size - size/2, rand() % size - size/2), velocity(rand() % size - size / 2, rand() % size - size / 2, rand() % size - size / 2), species(PREY) { }
 
-	Boid(int size, glm::vec3 offset)
-	: position(rand() % size - size / 2 + offset.x, rand() % size - size / 2 + offset.y, rand() % size - size / 2 + offset.z), velocity(rand() % size - size / 2, rand() % size - size / 2, rand() % size - size / 2) { }
+	Boid(int size, glm::vec3 offset, int kind = PREY)
+	: position(rand() % size - size / 2 + offset.x, rand() % size - size / 2 + offset.y, rand() % size - size / 2 + offset.z), velocity(rand() % size - size / 2, rand() % size - size / 2, rand() % size - size / 2), species(kind) { }
 
 };
 
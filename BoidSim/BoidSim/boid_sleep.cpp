@@ -0,0 +1,76 @@
+#include "boid_sleep.hpp"
+#include "spatial_hash.hpp"
+#include "flock.hpp"
+#include "distance_field.hpp"
+#include "obstacle_index.hpp"
+#include "flow_field.hpp"
+#include "fast_math.hpp"
+#include <atomic>
+
+bool useSleep = false;
+float sleepTurn = 0.05f;
+float wakeWallDistance = 30.0f;
+float wakeGoalDistance = 50.0f;
+const uint16_t MAX_SLEEP_STEPS = 60;
+SleepStats sleepStats;
+std::vector<uint8_t> lonely;
+std::vector<uint16_t> sleepSteps;
+
+std::atomic<uint32_t> wokenBySteering(0); // since the last updateSleep, steering threads wake boids at the same time
+
+bool isUndisturbed(const glm::vec3& position) {
+	float wallDistance;
+	glm::vec3 awayFromWall;
+	if (sampleDistanceField(position, wallDistance, awayFromWall) && wallDistance < wakeWallDistance) {
+		return false;
+	}
+	return !isInPointRange(position) && getGoalDistance(position) >= wakeGoalDistance;
+}
+
+void wakeUp(uint32_t i) {
+	sleepSteps[i] = 0;
+	lonely[i] = 0;
+	wokenBySteering++;
+}
+
+void updateSleep(const std::vector<glm::vec3>& steering) {
+	sleepStats = SleepStats();
+	sleepStats.woken = wokenBySteering.exchange(0);
+	// the player's line reaches every boid
+	if (!useSleep || repellLine || steering.size() != boids.size()) {
+		sleepSteps.clear();
+		lonely.clear();
+		return;
+	}
+	if (sleepSteps.size() != boids.size()) {
+		sleepSteps.assign(boids.size(), 0);
+		lonely.assign(boids.size(), 0);
+	}
+
+	for (uint32_t i = 0; i < boids.size(); i++) {
+		if (sleepSteps[i] > 0) {
+			if (sleepSteps[i] >= MAX_SLEEP_STEPS || !isUndisturbed(boids[i].position)) {
+				sleepSteps[i] = 0;
+				lonely[i] = 0;
+				sleepStats.woken++;
+			}
+			else {
+				sleepSteps[i]++;
+				sleepStats.asleep++;
+			}
+			continue;
+		}
+		if (!lonely[i]) {
+			continue;
+		}
+		// only the part of the steering across the velocity turns the boid
+		const Boid& b = boids[i];
+		glm::vec3 heading = safeNormalize(b.velocity);
+		glm::vec3 turn = steering[i] - glm::dot(steering[i], heading) * heading;
+		if (glm::length(turn) < sleepTurn * boidParameters.maxAcceleration[i] && isUndisturbed(b.position)) {
+			sleepSteps[i] = 1;
+			sleepStats.fellAsleep++;
+			sleepStats.asleep++;
+		}
+	}
+}
@@ -0,0 +1,45 @@
+#ifndef boid_sleep_hpp
+#define boid_sleep_hpp
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+
+// A boid with nobody around, nothing ahead and no wall close by that hardly turns falls asleep: it is not steered and
+// flies straight on until something comes close enough to matter, which wakes it up again. steerFlock wakes sleepers
+// that get a boid in their grid stencil, another species in range or a mesh ahead, from what it gathers for the whole
+// cell anyway, and updateSleep the ones that get close to a wall, a ranged point or a flow goal. Forces these checks do
+// not cover (the points without a range, the flow away from its goals, wind) are picked up because a sleeper wakes up
+// every MAX_SLEEP_STEPS anyway
+extern bool useSleep;
+extern float sleepTurn; // turning less than this times its maxAcceleration counts as flying straight
+extern float wakeWallDistance; // a sleeper wakes up when a wall is closer than this
+extern float wakeGoalDistance; // or a flow goal
+extern const uint16_t MAX_SLEEP_STEPS;
+
+struct SleepStats {
+	uint32_t asleep, fellAsleep; // in the last updateSleep
+	uint32_t woken; // by the last updateSleep and the steerFlock before it
+	SleepStats() : asleep(0), fellAsleep(0), woken(0) {}
+};
+extern SleepStats sleepStats;
+
+// Set by steerFlock for every boid it steers: whether it had no boids in its grid stencil, no other species in range and
+// no mesh ahead
+extern std::vector<uint8_t> lonely;
+// Steps each boid has slept, 0 if awake
+extern std::vector<uint16_t> sleepSteps;
+
+// Wakes the sleepers that are close to a wall or have slept long enough, and puts lonely boids away from walls that flew
+// straight (steering is what they got in the last step) to sleep. Call once per step before steerFlock
+void updateSleep(const std::vector<glm::vec3>& steering);
+// For steerFlock, safe to call from several threads for different boids
+void wakeUp(uint32_t i);
+// Whether no wall, ranged point or flow goal is close enough to position to steer a boid there much
+bool isUndisturbed(const glm::vec3& position);
+
+inline bool isAsleep(uint32_t i) {
+	return !sleepSteps.empty() && sleepSteps[i] > 0;
+}
+
+#endif
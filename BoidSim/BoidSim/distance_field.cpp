@@ -0,0 +1,85 @@
+#include "distance_field.hpp"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+const float MIN_FIELD_EXTENT = 100.0f; // smallest size of the grid along an axis, e.g. for a level with only a floor
+const int FIELD_MARGIN = 2; // voxels outside the walls' box
+
+DistanceField field;
+
+void bakeDistanceField(const std::vector<ObstaclePlane>& planes, float voxelSize){
+	field = DistanceField();
+	if(planes.empty()){
+		return;
+	}
+
+	glm::vec3 lo(FLT_MAX), hi(-FLT_MAX);
+	for(const ObstaclePlane& o : planes){
+		lo = glm::min(lo, o.point);
+		hi = glm::max(hi, o.point);
+	}
+	glm::vec3 centre = (lo + hi) * 0.5f;
+	glm::vec3 half = glm::max((hi - lo) * 0.5f, glm::vec3(MIN_FIELD_EXTENT * 0.5f)) + glm::vec3(FIELD_MARGIN * voxelSize);
+
+	field.voxelSize = voxelSize;
+	field.origin = centre - half;
+	field.nx = (int)std::ceil(2.0f * half.x / voxelSize) + 1;
+	field.ny = (int)std::ceil(2.0f * half.y / voxelSize) + 1;
+	field.nz = (int)std::ceil(2.0f * half.z / voxelSize) + 1;
+	field.distance.resize(field.nx * field.ny * field.nz);
+	field.gradient.resize(field.nx * field.ny * field.nz);
+
+	// the walls' normals point out of the room, so the distance inside is minus the distance along the normal
+	for(int z = 0; z < field.nz; z++){
+		for(int y = 0; y < field.ny; y++){
+			for(int x = 0; x < field.nx; x++){
+				glm::vec3 p = field.origin + glm::vec3(x, y, z) * voxelSize;
+				float closest = FLT_MAX;
+				glm::vec3 away(0.0f);
+				for(const ObstaclePlane& o : planes){
+					glm::vec3 n = glm::normalize(o.normal);
+					float d = -glm::dot(p - o.point, n);
+					if(d < closest){
+						closest = d;
+						away = -n;
+					}
+				}
+				int v = (z * field.ny + y) * field.nx + x;
+				field.distance[v] = closest;
+				field.gradient[v] = away;
+			}
+		}
+	}
+}
+
+bool hasDistanceField(){
+	return !field.distance.empty();
+}
+
+bool sampleDistanceField(const glm::vec3& p, float& distance, glm::vec3& gradient){
+	if(field.distance.empty()){
+		return false;
+	}
+	glm::vec3 g = (p - field.origin) * (1.0f / field.voxelSize);
+	glm::vec3 inside = glm::clamp(g, glm::vec3(0.0f), glm::vec3(field.nx - 1.001f, field.ny - 1.001f, field.nz - 1.001f));
+	int x = (int)inside.x, y = (int)inside.y, z = (int)inside.z;
+	glm::vec3 t = inside - glm::vec3(x, y, z);
+
+	distance = 0.0f;
+	gradient = glm::vec3(0.0f);
+	for(int c = 0; c < 8; c++){
+		int dx = c & 1, dy = (c >> 1) & 1, dz = (c >> 2) & 1;
+		float w = (dx ? t.x : 1.0f - t.x) * (dy ? t.y : 1.0f - t.y) * (dz ? t.z : 1.0f - t.z);
+		int v = ((z + dz) * field.ny + (y + dy)) * field.nx + (x + dx);
+		distance += w * field.distance[v];
+		gradient += w * field.gradient[v];
+	}
+	float length = glm::length(gradient);
+	if(length > 0.0f){
+		gradient *= 1.0f / length;
+	}
+	// continue the field linearly outside the grid
+	distance += glm::dot(gradient, (g - inside) * field.voxelSize);
+	return true;
+}
@@ -0,0 +1,26 @@
+#ifndef distance_field_hpp
+#define distance_field_hpp
+
+#include <vector>
+#include <glm/glm.hpp>
+#include "obstacleplane.h"
+
+// Signed distance to the closest wall (positive on the inside, where the boids are), together with the direction
+// away from it, baked on a grid of voxels when a level is loaded. Sampling it costs the same however many walls there are
+struct DistanceField {
+	glm::vec3 origin; // corner of the first voxel
+	float voxelSize;
+	int nx, ny, nz;
+	std::vector<float> distance;
+	std::vector<glm::vec3> gradient;
+	DistanceField() : origin(0.0f), voxelSize(1.0f), nx(0), ny(0), nz(0) {}
+};
+
+// Bakes the walls into the distance field. The grid covers the box spanned by the walls' points plus a margin
+void bakeDistanceField(const std::vector<ObstaclePlane>& planes, float voxelSize);
+// Trilinear sample at p, false if nothing has been baked. Outside the grid the field is continued linearly
+bool sampleDistanceField(const glm::vec3& p, float& distance, glm::vec3& gradient);
+// Whether anything has been baked, i.e. whether sampleDistanceField can return true
+bool hasDistanceField();
+
+#endif
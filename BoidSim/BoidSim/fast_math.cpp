@@ -0,0 +1,35 @@
+#include "fast_math.hpp"
+#include <algorithm>
+
+bool fastMath = true;
+bool newtonRefine = true;
+MathError mathError;
+
+const int MATH_ERROR_SAMPLES = 100000;
+
+void measureMathError() {
+	mathError = MathError();
+	// inputs spread evenly over the exponents the steering sees, from 1e-6 to 1e6
+	for (int s = 0; s < MATH_ERROR_SAMPLES; s++) {
+		float x = (float)std::pow(10.0, -6.0 + 12.0 * s / MATH_ERROR_SAMPLES);
+		double exact = 1.0 / std::sqrt((double)x);
+		mathError.inverseSqrt = std::max(mathError.inverseSqrt, (float)(std::abs(inverseSqrt(x) - exact) / exact));
+	}
+	uint32_t seed = 1; // a generator of its own, rand is what the levels are built from
+	for (int s = 0; s < MATH_ERROR_SAMPLES; s++) {
+		float c[3];
+		for (float& value : c) {
+			seed = seed * 1664525u + 1013904223u;
+			value = (float)(seed >> 8) / (1 << 24) * 2.0f - 1.0f;
+		}
+		float scale = std::pow(10.0f, (float)(s % 9 - 4)); // lengths from about 1e-4 to 1e4
+		glm::vec3 v = glm::vec3(c[0], c[1], c[2]) * scale;
+		double length = std::sqrt((double)v.x * v.x + (double)v.y * v.y + (double)v.z * v.z);
+		if (length == 0.0) {
+			continue;
+		}
+		glm::vec3 unit = safeNormalize(v);
+		double dx = unit.x - v.x / length, dy = unit.y - v.y / length, dz = unit.z - v.z / length;
+		mathError.normalize = std::max(mathError.normalize, (float)std::sqrt(dx * dx + dy * dy + dz * dz));
+	}
+}
@@ -0,0 +1,60 @@
+#ifndef fast_math_hpp
+#define fast_math_hpp
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <glm/glm.hpp>
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#endif
+
+// Square roots for the steering. With fastMath on, 1/sqrt comes from the processor's estimate (12 bits), refined by a
+// Newton step if newtonRefine is on (about 22 bits). Off, it is computed exactly. In both modes a zero vector
+// normalizes to zero instead of NaN, so one boid on top of another can not poison the flock
+extern bool fastMath;
+extern bool newtonRefine;
+
+// Largest errors of the current mode over a sweep of inputs, filled in by measureMathError
+struct MathError {
+	float inverseSqrt; // relative
+	float normalize; // length of the difference with the exact unit vector
+	MathError() : inverseSqrt(0.0f), normalize(0.0f) {}
+};
+extern MathError mathError;
+// Call after changing fastMath or newtonRefine
+void measureMathError();
+
+inline float estimateInverseSqrt(float x) {
+#if defined(__SSE__) || defined(_M_X64)
+	return _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+#else
+	uint32_t bits;
+	std::memcpy(&bits, &x, sizeof(bits));
+	bits = 0x5f375a86u - (bits >> 1);
+	float y;
+	std::memcpy(&y, &bits, sizeof(y));
+	return y * (1.5f - 0.5f * x * y * y); // the bit trick alone is too rough, this is as good as the SSE estimate
+#endif
+}
+
+// 1/sqrt(x) for x > 0
+inline float inverseSqrt(float x) {
+	if (!fastMath) {
+		return 1.0f / std::sqrt(x);
+	}
+	float y = estimateInverseSqrt(x);
+	return newtonRefine ? y * (1.5f - 0.5f * x * y * y) : y;
+}
+
+// v / |v|, or zero if v is zero
+inline glm::vec3 safeNormalize(const glm::vec3& v) {
+	float length2 = glm::dot(v, v);
+	if (!(length2 > 0.0f)) {
+		return glm::vec3(0.0f);
+	}
+	return fastMath ? v * inverseSqrt(length2) : glm::normalize(v);
+}
+
+#endif
@@ -0,0 +1,284 @@
+#include "flock.hpp"
+#include "spatial_hash.hpp"
+#include "distance_field.hpp"
+#include "obstacle_index.hpp"
+#include "obstacle_mesh.hpp"
+#include "flow_field.hpp"
+#include "steering_rules.hpp"
+#include "sim_lod.hpp"
+#include "boid_sleep.hpp"
+#include "parallel.hpp"
+#include "fast_math.hpp"
+#include "integrator.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// Boid attributes
+const float MAX_SPEED = 0.3f;
+const float MAX_ACCELERATION = 0.05f;
+const float SOFTNESS = 10.0f;
+const float LOOK_AHEAD = 30.0f;
+
+const uint32_t CELLS_PER_TASK = 64; // cells a steering thread takes at a time
+
+SpeciesParameters speciesParameters[NR_SPECIES] = {
+	// PREY
+	{ true, 25.0f, 0.0f, { MAX_SPEED, MAX_ACCELERATION, SOFTNESS, FLT_MAX, 1.0f, 1.0f, 2.0f, 10.0f, 10.0f, 10.0f, 5.0f, 10.0f, 5.0f, 1.0f } },
+	// PREDATOR, a bit faster and hunting alone
+	{ false, 0.0f, 40.0f, { 0.35f, MAX_ACCELERATION, SOFTNESS, FLT_MAX, 1.0f, 1.0f, 2.0f, 10.0f, 10.0f, 10.0f, 5.0f, 10.0f, 5.0f, 1.0f } },
+};
+ParameterColumns boidParameters;
+
+bool SteeringParameters::operator==(const SteeringParameters& o) const {
+	return maxSpeed == o.maxSpeed && maxAcceleration == o.maxAcceleration && softness == o.softness && radius == o.radius
+		&& alignment == o.alignment && cohesion == o.cohesion && separation == o.separation && plane == o.plane && point == o.point
+		&& mesh == o.mesh && flow == o.flow && flee == o.flee && chase == o.chase && line == o.line;
+}
+
+void ParameterColumns::reset() {
+	for (std::vector<float>* column : { &maxSpeed, &maxAcceleration, &softness, &radius, &alignment, &cohesion, &separation, &plane, &point, &mesh, &flow, &flee, &chase, &line }) {
+		column->resize(boids.size());
+	}
+	for (uint32_t i = 0; i < boids.size(); i++) {
+		write(i, speciesParameters[boids[i].species].steering);
+	}
+	uniform = allSame();
+}
+
+void ParameterColumns::set(uint32_t i, const SteeringParameters& p) {
+	write(i, p);
+	uniform = i == 0 ? allSame() : uniform && p == get(0);
+}
+
+void ParameterColumns::write(uint32_t i, const SteeringParameters& p) {
+	maxSpeed[i] = p.maxSpeed; maxAcceleration[i] = p.maxAcceleration; softness[i] = p.softness; radius[i] = p.radius;
+	alignment[i] = p.alignment; cohesion[i] = p.cohesion; separation[i] = p.separation; plane[i] = p.plane; point[i] = p.point;
+	mesh[i] = p.mesh; flow[i] = p.flow; flee[i] = p.flee; chase[i] = p.chase; line[i] = p.line;
+}
+
+bool ParameterColumns::allSame() const {
+	for (uint32_t i = 1; i < maxSpeed.size(); i++) {
+		if (!(get(i) == get(0))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+SteeringParameters ParameterColumns::get(uint32_t i) const {
+	return SteeringParameters{ maxSpeed[i], maxAcceleration[i], softness[i], radius[i], alignment[i], cohesion[i], separation[i], plane[i], point[i],
+		mesh[i], flow[i], flee[i], chase[i], line[i] };
+}
+
+glm::vec3 getSteering(const Boid& b, const FlockSums& sums, const SteeringParameters& p) {
+	return steeringKernels[ALL_RULES](b, sums, p);
+}
+
+unsigned getRuleMask(int species) {
+	const SpeciesParameters& parameters = speciesParameters[species];
+	return (hasDistanceField() ? WALL_RULES : 0) | (hasObstaclePoints() ? POINT_RULES : 0) | (hasObstacleMesh() ? MESH_RULES : 0)
+		| (hasFlowField() ? FLOW_RULES : 0) | (parameters.fleeRange > 0.0f || parameters.chaseRange > 0.0f ? SPECIES_RULES : 0)
+		| (repellLine ? LINE_RULES : 0);
+}
+
+// Looks for boids of another species around the boids of a tile's centre cell, with one grid query for the whole cell.
+// Prey sum up the predators in fleeRange, predators find the closest prey in chaseRange
+void addOtherSpecies(const NeighbourTile& tile, const SpeciesParameters& parameters, std::vector<FlockSums>& sums) {
+	thread_local std::vector<uint32_t> candidates;
+	float range = std::max(parameters.fleeRange, parameters.chaseRange);
+	if (range == 0.0f) {
+		return;
+	}
+	glm::vec3 lo(FLT_MAX), hi(-FLT_MAX);
+	for (uint32_t s = 0; s < tile.centreCount; s++) {
+		glm::vec3 position(tile.x[s], tile.y[s], tile.z[s]);
+		lo = glm::min(lo, position);
+		hi = glm::max(hi, position);
+	}
+	getSpeciesInBox(lo - range, hi + range, parameters.fleeRange > 0.0f ? PREDATOR : PREY, candidates);
+
+	for (uint32_t s = 0; s < tile.centreCount; s++) {
+		glm::vec3 position(tile.x[s], tile.y[s], tile.z[s]);
+		float closest2 = parameters.chaseRange * parameters.chaseRange;
+		for (uint32_t c : candidates) {
+			glm::vec3 offset = wrapOffset(boids[c].position - position);
+			float d2 = glm::dot(offset, offset);
+			if (d2 == 0.0f) {
+				continue;
+			}
+			if (d2 < parameters.fleeRange * parameters.fleeRange) {
+				sums[s].fleeSum -= offset * (1.0f / d2);
+			}
+			if (d2 < closest2) {
+				closest2 = d2;
+				sums[s].preyOffset = offset;
+				sums[s].chasing = true;
+			}
+		}
+	}
+}
+
+// Walks the grid cell by cell and species by species. The boids of a species around a cell are copied once into a
+// small tile, and all boids of that species in the cell find their neighbours in that tile, which stays in the cache
+// while it is being used. Other species are looked for once per cell.
+// With Uniform all boids use the parameters of boid 0, otherwise each boid's are read from the columns.
+// Each species is steered by the kernel with only the rules that can act on it this frame.
+// Runs of CELLS_PER_TASK cells are handed out to the steering threads, each with its own tile and buffers
+template <bool Uniform>
+void steerCells(std::vector<glm::vec3>& steering, std::vector<FlockSums>* sumsOut, float dt, const std::vector<glm::vec3>& wind) {
+	const SteeringParameters shared = boidParameters.get(0);
+	SteeringKernel kernels[NR_SPECIES];
+	for (int species = 0; species < NR_SPECIES; species++) {
+		kernels[species] = steeringKernels[getRuleMask(species)];
+	}
+	// a species without boids is not looked for, so prey in a world without predators does not query the grid for them
+	uint32_t speciesCount[NR_SPECIES] = {};
+	for (const Boid& b : boids) {
+		speciesCount[b.species]++;
+	}
+
+	// every run counts its queries apart, they are added up in order afterwards
+	const uint32_t nrCells = getNrCells();
+	std::vector<NeighbourStats> taskStats((nrCells + CELLS_PER_TASK - 1) / CELLS_PER_TASK);
+
+	parallelFor(nrCells, CELLS_PER_TASK, [&](uint32_t begin, uint32_t end) {
+		thread_local NeighbourTile tile;
+		thread_local std::vector<uint32_t> nb;
+		thread_local std::vector<FlockSums> cellSums;
+		thread_local std::vector<glm::vec3> origins, directions;
+		thread_local std::vector<MeshHit> hits;
+		threadNeighbourStats = &taskStats[begin / CELLS_PER_TASK];
+		for (uint32_t c = begin; c < end; c++) {
+			for (int species = 0; species < NR_SPECIES; species++) {
+				loadTile(c, species, tile);
+				if (tile.centreCount == 0) {
+					continue;
+				}
+				const SpeciesParameters& parameters = speciesParameters[species];
+				const SteeringKernel steer = kernels[species];
+				cellSums.assign(tile.centreCount, FlockSums());
+
+				// look ahead for meshes, all boids of the cell at once
+				if (hasObstacleMesh()) {
+					origins.resize(tile.centreCount);
+					directions.resize(tile.centreCount);
+					for (uint32_t s = 0; s < tile.centreCount; s++) {
+						glm::vec3 velocity(tile.vx[s], tile.vy[s], tile.vz[s]);
+						origins[s] = glm::vec3(tile.x[s], tile.y[s], tile.z[s]);
+						directions[s] = safeNormalize(velocity);
+					}
+					castRays(origins, directions, LOOK_AHEAD, hits);
+					for (uint32_t s = 0; s < tile.centreCount; s++) {
+						cellSums[s].meshDistance = hits[s].distance;
+						cellSums[s].meshNormal = hits[s].normal;
+					}
+				}
+				if (speciesCount[parameters.fleeRange > 0.0f ? PREDATOR : PREY] > 0) {
+					addOtherSpecies(tile, parameters, cellSums);
+				}
+
+				for (uint32_t s = 0; s < tile.centreCount; s++) {
+					FlockSums& sums = cellSums[s];
+					uint32_t i = tile.index[s];
+					bool alone = tile.size == 1 && sums.fleeSum == glm::vec3(0.0f) && !sums.chasing && sums.meshDistance >= LOOK_AHEAD
+						&& (sleepSteps.empty() || isUndisturbed(boids[i].position));
+					if (isAsleep(i)) {
+						if (alone) {
+							continue; // flies straight on, see boid_sleep.hpp
+						}
+						wakeUp(i);
+					}
+					if (!isSteered(i)) {
+						continue; // flies straight on this step, see sim_lod.hpp
+					}
+					const SteeringParameters p = Uniform ? shared : boidParameters.get(i);
+					if (parameters.flocks) {
+						getTileNeighbours(tile, s, nb);
+						if (deterministicMode) {
+							std::sort(nb.begin(), nb.end(), [](uint32_t n, uint32_t m) { return tile.index[n] < tile.index[m]; });
+						}
+						glm::vec3 position(tile.x[s], tile.y[s], tile.z[s]);
+						const float radius2 = p.radius < boidScope ? p.radius * p.radius : FLT_MAX;
+						for (uint32_t n : nb) {
+							glm::vec3 offset = position - glm::vec3(tile.x[n], tile.y[n], tile.z[n]);
+							float distance2 = glm::dot(offset, offset);
+							if (distance2 >= radius2) {
+								continue; // this boid does not see as far as the grid
+							}
+							sums.velocitySum += glm::vec3(tile.vx[n], tile.vy[n], tile.vz[n]);
+							sums.positionSum += position - offset;
+							//separation += normalize(b.position - neighbour.position) * SOFTNESS / (pow(distance(b.position, neighbour.position),2) + 0.0001); // + 0.0001 is for avoiding divide by zero
+							sums.separationSum += fastMath ? offset * (1.0f / distance2) : normalize(offset) / glm::length(offset); // the same, without square roots
+							sums.nearCount += 1.0f;
+						}
+						sums.count = sums.nearCount;
+
+						if (useFarField) {
+							FarField far = getFarField(i);
+							sums.velocitySum += far.velocitySum;
+							sums.positionSum += far.positionSum;
+							sums.count += far.count;
+						}
+					}
+
+					steering[i] = steer(boids[i], sums, p);
+					if (!lonely.empty()) {
+						lonely[i] = alone && sums.count == 0.0f;
+					}
+					if (sumsOut) {
+						// semi-implicit Euler only steers again in substeps
+						glm::vec3 extra = wind.empty() ? glm::vec3(0.0f) : wind[i];
+						boidSubsteps[i] = (uint8_t)findSubsteps(steer, i, steering[i] + extra, sums, p, extra, dt);
+						if (integrator != SEMI_IMPLICIT_EULER || boidSubsteps[i] > 1) {
+							(*sumsOut)[i] = sums;
+						}
+					}
+				}
+			}
+		}
+		threadNeighbourStats = &neighbourStats;
+	});
+
+	for (const NeighbourStats& stats : taskStats) {
+		neighbourStats.add(stats);
+	}
+}
+
+void steerFlock(std::vector<glm::vec3>& steering, std::vector<FlockSums>* sums, float dt, const std::vector<glm::vec3>& wind) {
+	steering.resize(boids.size());
+	if (sums) {
+		sums->resize(boids.size());
+		boidSubsteps.resize(boids.size());
+	}
+	if (boidParameters.maxSpeed.size() != boids.size()) {
+		boidParameters.reset();
+	}
+	if (boidParameters.uniform) {
+		steerCells<true>(steering, sums, dt, wind);
+	}
+	else {
+		steerCells<false>(steering, sums, dt, wind);
+	}
+}
+
+glm::vec3 getFlockCentre() {
+	std::vector<glm::vec3> positions(boids.size());
+	for (uint32_t i = 0; i < boids.size(); i++) {
+		positions[i] = boids[i].position;
+	}
+	return boids.empty() ? glm::vec3(0.0f) : treeSum(positions) * (1.0f / boids.size());
+}
+
+uint64_t getFlockChecksum() {
+	uint64_t hash = 14695981039346656037ull; // FNV-1a
+	for (const Boid& b : boids) {
+		const float values[6] = { b.position.x, b.position.y, b.position.z, b.velocity.x, b.velocity.y, b.velocity.z };
+		for (float value : values) {
+			uint32_t bits;
+			std::memcpy(&bits, &value, sizeof(bits));
+			hash = (hash ^ bits) * 1099511628211ull;
+		}
+	}
+	return hash;
+}
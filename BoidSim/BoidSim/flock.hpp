@@ -0,0 +1,91 @@
+#ifndef flock_hpp
+#define flock_hpp
+
+#include <cfloat>
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+#include "boid.h"
+#include "obstacleplane.h"
+#include "obstaclepoint.h"
+
+// Boid attributes
+extern const float MAX_SPEED;
+extern const float MAX_ACCELERATION;
+extern const float SOFTNESS;
+extern const float LOOK_AHEAD; // how far ahead a boid looks for meshes
+
+// What getSteering needs to know about a boid apart from its surroundings
+struct SteeringParameters {
+	float maxSpeed, maxAcceleration, softness;
+	float radius; // how far the boid sees others of its kind, at most boidScope
+	float alignment, cohesion, separation, plane, point, mesh, flow, flee, chase, line; // weights of the rules
+	bool operator==(const SteeringParameters& o) const;
+};
+
+// What makes one species behave differently from another. steering is what its boids start out with
+struct SpeciesParameters {
+	bool flocks; // follows the flocking rules with others of its own species
+	float fleeRange; // predators closer than this are fled from, 0 if it fears nothing
+	float chaseRange; // the closest prey within this is chased, 0 if it does not hunt
+	SteeringParameters steering;
+};
+extern SpeciesParameters speciesParameters[NR_SPECIES];
+
+// The SteeringParameters of every boid, one column per parameter, indexed like boids.
+// When all boids have the same parameters steerFlock takes a path that reads them from one place
+struct ParameterColumns {
+	std::vector<float> maxSpeed, maxAcceleration, softness, radius;
+	std::vector<float> alignment, cohesion, separation, plane, point, mesh, flow, flee, chase, line;
+	bool uniform; // kept up to date by set and reset
+	ParameterColumns() : uniform(true) {}
+	// Gives every boid its species' parameters
+	void reset();
+	void set(uint32_t i, const SteeringParameters& p);
+	SteeringParameters get(uint32_t i) const;
+private:
+	void write(uint32_t i, const SteeringParameters& p);
+	bool allSame() const;
+};
+extern ParameterColumns boidParameters;
+
+// What the flocking rules need to know about a boid's neighbours and surroundings
+struct FlockSums {
+	float nearCount; // neighbours within sight, the ones separation is computed from
+	float count; // nearCount plus boids seen in the far field
+	glm::vec3 velocitySum, positionSum, separationSum;
+	float meshDistance; // to the mesh the boid is heading for, FLT_MAX if none within LOOK_AHEAD
+	glm::vec3 meshNormal;
+	glm::vec3 fleeSum; // away from the predators within fleeRange, weighted by 1/distance
+	glm::vec3 preyOffset; // to the closest prey within chaseRange, valid if chasing
+	bool chasing;
+	FlockSums() : nearCount(0.0f), count(0.0f), velocitySum(0.0f), positionSum(0.0f), separationSum(0.0f), meshDistance(FLT_MAX), meshNormal(0.0f),
+		fleeSum(0.0f), preyOffset(0.0f), chasing(false) {}
+};
+
+// Flocking rules plus obstacles and the player's line, for boid b with parameters p and the neighbours summed up in sums.
+// Runs every rule in steering_rules.hpp, steerFlock leaves out the ones that can not act
+glm::vec3 getSteering(const Boid& b, const FlockSums& sums, const SteeringParameters& p);
+// A function like getSteering with only some of the rules, see steeringKernels
+typedef glm::vec3 (*SteeringKernel)(const Boid& b, const FlockSums& sums, const SteeringParameters& p);
+// The OptionalRule bits of the rules that can do anything this step for boids of the given species, so that
+// steeringKernels[getRuleMask(species)] steers them like getSteering, only faster
+unsigned getRuleMask(int species);
+// Computes the steering of every boid, cell by cell. The hash table must be filled and packed.
+// If sums is given the boids are also readied for an integrateFlock step of dt with the given wind (see integrator.hpp):
+// boidSubsteps is set, and sums gets what the steering was computed from for the boids the integrator steers again
+// during the step, indexed like boids
+void steerFlock(std::vector<glm::vec3>& steering, std::vector<FlockSums>* sums = nullptr, float dt = 1.0f,
+	const std::vector<glm::vec3>& wind = std::vector<glm::vec3>());
+
+// Centre of all boids, added up by treeSum so it has the same bits however many threads steered them
+glm::vec3 getFlockCentre();
+// Hash of the bits of every boid's position and velocity, for checking that two runs went exactly the same
+uint64_t getFlockChecksum();
+
+extern std::vector<ObstaclePlane> walls;
+extern std::vector<ObstaclePoint> objects;
+extern glm::vec3 cameraDir, cameraPos;
+extern bool repellLine;
+
+#endif
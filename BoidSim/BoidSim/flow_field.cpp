@@ -0,0 +1,275 @@
+#include "flow_field.hpp"
+#include "distance_field.hpp"
+#include "obstacle_mesh.hpp"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <functional>
+#include <queue>
+
+const uint32_t FLOW_UPDATE_BUDGET = 5000; // voxels per frame while recomputing
+const float UNREACHABLE = FLT_MAX;
+
+struct FlowBuffer {
+	std::vector<float> distance; // along the shortest path to a goal
+	std::vector<glm::vec3> direction; // towards the neighbour closest to a goal
+};
+
+glm::vec3 flowOrigin; // centre of the first voxel
+float flowVoxelSize = 1.0f;
+int flowSize = 0; // voxels along each axis
+std::vector<uint8_t> blocked;
+FlowBuffer front, back; // boids sample front, back is being recomputed
+
+// the 26 neighbours and the length of the step to each
+int neighbourOffset[26][3];
+float neighbourCost[26];
+// the voxels next to both ends of a diagonal step (as offsets in the voxel arrays), which have to be open as well so
+// that paths do not cut corners
+int stepCorners[26][6];
+int nrStepCorners[26];
+
+// state of the recomputation, done in steps: march out from the goals, then find the directions
+enum FlowStep { FLOW_DONE, FLOW_MARCHING, FLOW_DIRECTIONS };
+FlowStep flowStep = FLOW_DONE;
+std::priority_queue<std::pair<float, uint32_t>, std::vector<std::pair<float, uint32_t>>, std::greater<std::pair<float, uint32_t>>> open;
+uint32_t nextDirection;
+std::vector<uint32_t> goalVoxels; // the goals' voxels the field was last computed for
+std::vector<glm::vec3> goalPositions; // where the goals are now
+
+uint32_t getVoxel(int x, int y, int z) {
+	return ((uint32_t)z * flowSize + y) * flowSize + x;
+}
+
+// Whether the step from voxel v to its neighbour n, which is inside the grid, passes no blocked voxel
+bool isOpenStep(uint32_t v, int n) {
+	for (int c = 0; c < nrStepCorners[n]; c++) {
+		if (blocked[v + stepCorners[n][c]]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool getGoalVoxel(const glm::vec3& p, uint32_t& voxel) {
+	glm::vec3 g = glm::floor((p - flowOrigin) / flowVoxelSize + 0.5f);
+	if (g.x < 0 || g.y < 0 || g.z < 0 || g.x >= flowSize || g.y >= flowSize || g.z >= flowSize) {
+		return false;
+	}
+	voxel = getVoxel((int)g.x, (int)g.y, (int)g.z);
+	return !blocked[voxel];
+}
+
+void startFlowUpdate(const std::vector<Goal>& goals) {
+	goalVoxels.clear();
+	for (const Goal& g : goals) {
+		uint32_t v;
+		if (getGoalVoxel(g.position, v)) {
+			goalVoxels.push_back(v);
+		}
+	}
+	back.distance.assign(blocked.size(), UNREACHABLE);
+	back.direction.assign(blocked.size(), glm::vec3(0.0f));
+	open = decltype(open)();
+	for (uint32_t v : goalVoxels) {
+		back.distance[v] = 0.0f;
+		open.push({ 0.0f, v });
+	}
+	flowStep = FLOW_MARCHING;
+}
+
+// Dijkstra over the voxels, a voxel can be taken several times from the queue, only the first one counts
+void marchFlow(uint32_t& budget) {
+	while (budget > 0 && !open.empty()) {
+		std::pair<float, uint32_t> top = open.top();
+		open.pop();
+		uint32_t v = top.second;
+		if (top.first > back.distance[v]) {
+			continue;
+		}
+		budget--;
+		int x = v % flowSize, y = v / flowSize % flowSize, z = v / (flowSize * flowSize);
+		for (int n = 0; n < 26; n++) {
+			int nx = x + neighbourOffset[n][0], ny = y + neighbourOffset[n][1], nz = z + neighbourOffset[n][2];
+			if (nx < 0 || ny < 0 || nz < 0 || nx >= flowSize || ny >= flowSize || nz >= flowSize) {
+				continue;
+			}
+			uint32_t w = getVoxel(nx, ny, nz);
+			float d = top.first + neighbourCost[n];
+			if (!blocked[w] && d < back.distance[w] && isOpenStep(v, n)) {
+				back.distance[w] = d;
+				open.push({ d, w });
+			}
+		}
+	}
+	if (open.empty()) {
+		flowStep = FLOW_DIRECTIONS;
+		nextDirection = 0;
+	}
+}
+
+void findFlowDirections(uint32_t& budget) {
+	for (; budget > 0 && nextDirection < blocked.size(); budget--, nextDirection++) {
+		uint32_t v = nextDirection;
+		if (back.distance[v] == UNREACHABLE || back.distance[v] == 0.0f) {
+			continue;
+		}
+		int x = v % flowSize, y = v / flowSize % flowSize, z = v / (flowSize * flowSize);
+		float best = back.distance[v];
+		for (int n = 0; n < 26; n++) {
+			int nx = x + neighbourOffset[n][0], ny = y + neighbourOffset[n][1], nz = z + neighbourOffset[n][2];
+			if (nx < 0 || ny < 0 || nz < 0 || nx >= flowSize || ny >= flowSize || nz >= flowSize) {
+				continue;
+			}
+			float d = back.distance[getVoxel(nx, ny, nz)];
+			if (d < best && isOpenStep(v, n)) {
+				best = d;
+				back.direction[v] = glm::normalize(glm::vec3(neighbourOffset[n][0], neighbourOffset[n][1], neighbourOffset[n][2]));
+			}
+		}
+	}
+	if (nextDirection == blocked.size()) {
+		std::swap(front, back);
+		flowStep = FLOW_DONE;
+	}
+}
+
+void buildFlowField(const std::vector<Goal>& goals, float halfSize, float voxelSize) {
+	flowVoxelSize = voxelSize;
+	flowSize = (int)std::ceil(2.0f * halfSize / voxelSize);
+	flowOrigin = glm::vec3(-halfSize + 0.5f * voxelSize);
+	front = back = FlowBuffer();
+	flowStep = FLOW_DONE;
+	goalPositions.clear();
+	for (const Goal& g : goals) {
+		goalPositions.push_back(g.position);
+	}
+	if (goals.empty()) {
+		blocked.clear();
+		return;
+	}
+
+	int n = 0;
+	for (int z = -1; z <= 1; z++)
+		for (int y = -1; y <= 1; y++)
+			for (int x = -1; x <= 1; x++)
+				if (x != 0 || y != 0 || z != 0) {
+					neighbourOffset[n][0] = x;
+					neighbourOffset[n][1] = y;
+					neighbourOffset[n][2] = z;
+					neighbourCost[n] = std::sqrt((float)(x * x + y * y + z * z)) * voxelSize;
+					// every voxel in the box the step spans, except its two ends
+					nrStepCorners[n] = 0;
+					for (int m = 1; m < 7; m++) {
+						int cx = (m & 1) ? x : 0, cy = (m & 2) ? y : 0, cz = (m & 4) ? z : 0;
+						bool end = (cx == x && cy == y && cz == z) || (cx == 0 && cy == 0 && cz == 0);
+						bool seen = false;
+						int offset = (cz * flowSize + cy) * flowSize + cx;
+						for (int c = 0; c < nrStepCorners[n]; c++) {
+							seen = seen || stepCorners[n][c] == offset;
+						}
+						if (!end && !seen) {
+							stepCorners[n][nrStepCorners[n]++] = offset;
+						}
+					}
+					n++;
+				}
+
+	// a voxel is blocked if a wall is closer than half a voxel or a mesh might be in it
+	blocked.assign((size_t)flowSize * flowSize * flowSize, 0);
+	glm::vec3 half(0.5f * voxelSize);
+	for (int z = 0; z < flowSize; z++)
+		for (int y = 0; y < flowSize; y++)
+			for (int x = 0; x < flowSize; x++) {
+				glm::vec3 centre = flowOrigin + glm::vec3(x, y, z) * voxelSize;
+				float wallDistance;
+				glm::vec3 awayFromWall;
+				bool wall = sampleDistanceField(centre, wallDistance, awayFromWall) && wallDistance < 0.5f * voxelSize;
+				blocked[getVoxel(x, y, z)] = wall || meshOverlapsBox(centre - half, centre + half);
+			}
+
+	startFlowUpdate(goals);
+	uint32_t budget = UINT32_MAX;
+	marchFlow(budget);
+	findFlowDirections(budget);
+}
+
+void updateFlowField(std::vector<Goal>& goals, float dt) {
+	if (blocked.empty()) {
+		return;
+	}
+	float halfSize = 0.5f * flowSize * flowVoxelSize;
+	goalPositions.clear();
+	for (Goal& g : goals) {
+		g.position += g.velocity * dt;
+		for (int a = 0; a < 3; a++) {
+			if (std::abs(g.position[a]) > halfSize) {
+				g.velocity[a] = -g.velocity[a];
+				g.position[a] = glm::clamp(g.position[a], -halfSize, halfSize);
+			}
+		}
+		goalPositions.push_back(g.position);
+	}
+
+	// start over if a goal is in another voxel than the field was computed for, but only once the recompute in
+	// progress is done, otherwise a goal that keeps crossing voxels would never let one finish
+	if (flowStep == FLOW_DONE) {
+		size_t found = 0;
+		bool same = true;
+		for (const Goal& g : goals) {
+			uint32_t v;
+			if (getGoalVoxel(g.position, v)) {
+				same = same && found < goalVoxels.size() && goalVoxels[found] == v;
+				found++;
+			}
+		}
+		if (!same || found != goalVoxels.size()) {
+			startFlowUpdate(goals);
+		}
+	}
+
+	uint32_t budget = FLOW_UPDATE_BUDGET;
+	if (flowStep == FLOW_MARCHING) {
+		marchFlow(budget);
+	}
+	if (flowStep == FLOW_DIRECTIONS) {
+		findFlowDirections(budget);
+	}
+}
+
+bool hasFlowField() {
+	return !front.direction.empty();
+}
+
+float getGoalDistance(const glm::vec3& p) {
+	if (front.direction.empty()) {
+		return FLT_MAX;
+	}
+	float closest2 = FLT_MAX;
+	for (const glm::vec3& g : goalPositions) {
+		closest2 = std::min(closest2, glm::dot(g - p, g - p));
+	}
+	return std::sqrt(closest2);
+}
+
+bool sampleFlowField(const glm::vec3& p, glm::vec3& direction) {
+	if (front.direction.empty()) {
+		return false;
+	}
+	glm::vec3 g = glm::clamp((p - flowOrigin) / flowVoxelSize, glm::vec3(0.0f), glm::vec3(flowSize - 1.001f));
+	int x = (int)g.x, y = (int)g.y, z = (int)g.z;
+	glm::vec3 t = g - glm::vec3(x, y, z);
+
+	direction = glm::vec3(0.0f);
+	for (int c = 0; c < 8; c++) {
+		int dx = c & 1, dy = (c >> 1) & 1, dz = (c >> 2) & 1;
+		float w = (dx ? t.x : 1.0f - t.x) * (dy ? t.y : 1.0f - t.y) * (dz ? t.z : 1.0f - t.z);
+		direction += w * front.direction[getVoxel(x + dx, y + dy, z + dz)];
+	}
+	float length = glm::length(direction);
+	if (length == 0.0f) {
+		return false;
+	}
+	direction *= 1.0f / length;
+	return true;
+}
@@ -0,0 +1,27 @@
+#ifndef flow_field_hpp
+#define flow_field_hpp
+
+#include <vector>
+#include <glm/glm.hpp>
+
+// Something the whole flock wants to get to
+struct Goal {
+	glm::vec3 position, velocity;
+	Goal(glm::vec3 p, glm::vec3 v = glm::vec3(0.0f)) : position(p), velocity(v) {}
+};
+
+// Shortest paths to the closest goal around walls and meshes, on a grid of voxels covering a box of the given half size.
+// Call after the walls' distance field and the mesh are in place. Computed in full here
+void buildFlowField(const std::vector<Goal>& goals, float halfSize, float voxelSize);
+// Moves the goals by dt times their velocity, bouncing inside the box. When a goal moves to another voxel the field is recomputed a few
+// thousand voxels per frame in a second buffer, and the boids keep using the old one until it is done. Goals that move
+// on in the meantime are picked up by the next recompute
+void updateFlowField(std::vector<Goal>& goals, float dt);
+// Direction of the shortest path at p, false if there are no goals or p can not reach one
+bool sampleFlowField(const glm::vec3& p, glm::vec3& direction);
+// Whether there is a field to follow, i.e. whether sampleFlowField can return true
+bool hasFlowField();
+// Straight distance from p to the closest goal as it was last moved, FLT_MAX without a field
+float getGoalDistance(const glm::vec3& p);
+
+#endif
@@ -0,0 +1,137 @@
+#include "integrator.hpp"
+#include "spatial_hash.hpp"
+#include "sim_lod.hpp"
+#include "boid_sleep.hpp"
+#include "fast_math.hpp"
+#include "steering_rules.hpp"
+#include "distance_field.hpp"
+#include "obstacle_index.hpp"
+#include <algorithm>
+#include <cmath>
+
+int integrator = SEMI_IMPLICIT_EULER;
+const char* integratorNames[NR_INTEGRATORS] = { "Semi-implicit Euler", "Velocity Verlet", "RK2 (midpoint)" };
+bool adaptiveSubsteps = true;
+float substepTolerance = 0.5f;
+float stiffDistance = 20.0f;
+const int MAX_SUBSTEPS = 8;
+std::vector<uint8_t> boidSubsteps;
+IntegratorStats integratorStats;
+
+// What a boid steers towards at position x with velocity v, with the neighbours it had at the start of the step
+glm::vec3 getAcceleration(SteeringKernel steer, const Boid& b, glm::vec3 x, glm::vec3 v, const FlockSums& sums, const SteeringParameters& p, glm::vec3 extra) {
+	Boid moved = b;
+	moved.position = wrapPosition(x);
+	moved.velocity = v;
+	return steer(moved, sums, p) + extra;
+}
+
+glm::vec3 limitSpeed(glm::vec3 v, float maxSpeed) {
+	return safeNormalize(v) * maxSpeed;
+}
+
+// One (sub)step of length h from x, v, where the acceleration is a
+void integrateBoid(SteeringKernel steer, const Boid& b, glm::vec3& x, glm::vec3& v, glm::vec3 a, float h, const FlockSums& sums, const SteeringParameters& p, glm::vec3 extra) {
+	switch (integrator) {
+	case VELOCITY_VERLET: {
+		// only the part of a that turns the boid moves it, its speed stays the same
+		float speed2 = glm::dot(v, v);
+		glm::vec3 turn = speed2 > 1e-12f ? a - glm::dot(a, v) / speed2 * v : a;
+		glm::vec3 next = x + v * h + turn * (0.5f * h * h);
+		glm::vec3 aNext = getAcceleration(steer, b, next, limitSpeed(v + a * h, p.maxSpeed), sums, p, extra);
+		v = limitSpeed(v + (a + aNext) * (0.5f * h), p.maxSpeed);
+		x = next;
+		break;
+	}
+	case RK2: {
+		glm::vec3 vHalf = limitSpeed(v + a * (0.5f * h), p.maxSpeed);
+		glm::vec3 aHalf = getAcceleration(steer, b, x + v * (0.5f * h), vHalf, sums, p, extra);
+		v = limitSpeed(v + aHalf * h, p.maxSpeed);
+		x = x + vHalf * h;
+		break;
+	}
+	default:
+		v = limitSpeed(v + a * h, p.maxSpeed);
+		x = x + v * h;
+	}
+}
+
+// Whether a force that grows quickly close by (a wall, a ranged point, the player's line) acts on a boid at position.
+// A 1/distance force changes by about dt/distance^2 over a step, so what counts as close grows with the root of dt
+bool isNearStiffForce(const glm::vec3& position, float dt) {
+	const float range = stiffDistance * std::sqrt(dt);
+	float wallDistance;
+	glm::vec3 awayFromWall;
+	if (sampleDistanceField(position, wallDistance, awayFromWall) && wallDistance < range) {
+		return true;
+	}
+	if (repellLine) {
+		glm::vec3 point = cameraPos + glm::dot(position - cameraPos, cameraDir) / glm::dot(cameraDir, cameraDir) * cameraDir;
+		if (glm::dot(position - point, position - point) < range * range) {
+			return true;
+		}
+	}
+	return isInPointRange(position);
+}
+
+// The velocity boid i starts its step with, made up for the steps sim_lod.hpp left it out of
+glm::vec3 getStartVelocity(uint32_t i, glm::vec3 a, const SteeringParameters& p, float dt) {
+	glm::vec3 v = limitSpeed(boids[i].velocity, p.maxSpeed);
+	if (!lodSteps.empty() && lodSteps[i] > 1) {
+		v = limitSpeed(v + a * ((lodSteps[i] - 1) * dt), p.maxSpeed);
+	}
+	return v;
+}
+
+int findSubsteps(SteeringKernel steer, uint32_t i, glm::vec3 a, const FlockSums& sums, const SteeringParameters& p, glm::vec3 extra, float dt) {
+	const Boid& b = boids[i];
+	if (!adaptiveSubsteps || !isNearStiffForce(b.position, dt)) {
+		return 1;
+	}
+	// try the end of the step, the more the steering changes there the more substeps
+	glm::vec3 v = getStartVelocity(i, a, p, dt);
+	glm::vec3 aEnd = getAcceleration(steer, b, b.position + v * dt, limitSpeed(v + a * dt, p.maxSpeed), sums, p, extra);
+	float change = glm::length(aEnd - a) / (substepTolerance * p.maxAcceleration);
+	return glm::clamp((int)std::ceil(change), 1, MAX_SUBSTEPS);
+}
+
+void integrateFlock(const std::vector<glm::vec3>& steering, const std::vector<FlockSums>& sums, const std::vector<glm::vec3>& wind, float dt) {
+	integratorStats = IntegratorStats();
+	integratorStats.boids = (uint32_t)boids.size();
+	const FlockSums noSums; // semi-implicit Euler without substeps never needs them
+	SteeringKernel kernels[NR_SPECIES];
+	for (int species = 0; species < NR_SPECIES; species++) {
+		kernels[species] = steeringKernels[getRuleMask(species)];
+	}
+	for (uint32_t i = 0; i < boids.size(); i++) {
+		Boid& b = boids[i];
+		const SteeringParameters p = boidParameters.get(i);
+		glm::vec3 extra = wind.empty() ? glm::vec3(0.0f) : wind[i];
+		glm::vec3 a = steering[i] + extra;
+		glm::vec3 x = b.position, v = limitSpeed(b.velocity, p.maxSpeed);
+		if (!isSteered(i) || isAsleep(i)) {
+			b.position = wrapPosition(x + v * dt);
+			b.velocity = v;
+			continue;
+		}
+		v = getStartVelocity(i, a, p, dt);
+		const FlockSums& s = sums.empty() ? noSums : sums[i];
+		const SteeringKernel steer = kernels[b.species];
+
+		int substeps = adaptiveSubsteps && boidSubsteps.size() == boids.size() ? boidSubsteps[i] : 1;
+		if (substeps > 1) {
+			integratorStats.substepped++;
+			integratorStats.substeps += substeps;
+		}
+
+		float h = dt / substeps;
+		for (int k = 0; k < substeps; k++) {
+			if (k > 0) {
+				a = getAcceleration(steer, b, x, v, s, p, extra);
+			}
+			integrateBoid(steer, b, x, v, a, h, s, p, extra);
+		}
+		b.position = wrapPosition(x);
+		b.velocity = v;
+	}
+}
@@ -0,0 +1,42 @@
+#ifndef integrator_hpp
+#define integrator_hpp
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+#include "flock.hpp"
+
+// How boids are moved from one step to the next. Semi-implicit Euler takes the steering once per step, the other two
+// take it again further along the step, which keeps them stable near walls with longer steps
+enum Integrator { SEMI_IMPLICIT_EULER, VELOCITY_VERLET, RK2, NR_INTEGRATORS };
+extern int integrator;
+extern const char* integratorNames[NR_INTEGRATORS];
+
+// A boid whose steering changes by more than substepTolerance * its maxAcceleration over a step (found by trying the
+// end of the step) takes up to MAX_SUBSTEPS shorter steps instead. Only the boids close to a wall or the player's line,
+// or in reach of a ranged point, are tried: the rest has no force that changes much over a step
+extern bool adaptiveSubsteps;
+extern float substepTolerance;
+extern float stiffDistance; // what counts as close for steps of one TIME_UNIT
+extern const int MAX_SUBSTEPS;
+// Substeps of every boid in the next integrateFlock, indexed like boids, set by steerFlock for the boids it steers
+extern std::vector<uint8_t> boidSubsteps;
+
+struct IntegratorStats {
+	uint32_t boids, substepped, substeps; // of the last step
+	IntegratorStats() : boids(0), substepped(0), substeps(0) {}
+};
+extern IntegratorStats integratorStats;
+
+// For steerFlock, safe to call from several threads for different boids: the substeps boid i needs for a step of dt when
+// it steers with kernel steer from sums and p, a being its steering with extra (the wind) added
+int findSubsteps(SteeringKernel steer, uint32_t i, glm::vec3 a, const FlockSums& sums, const SteeringParameters& p, glm::vec3 extra, float dt);
+
+// Moves every boid dt (in TIME_UNITs) forward and keeps its speed at maxSpeed. steering, sums and boidSubsteps are what
+// steerFlock gave for the boids as they are now for the same dt and wind (sums may be empty for semi-implicit Euler
+// without substeps), and wind (if not empty) is added to the steering. The neighbours are taken to stay
+// where they are during the step, the rest of the rules are evaluated again where the integrator needs them.
+// Boids that sim_lod.hpp leaves out this step and sleeping boids fly straight on
+void integrateFlock(const std::vector<glm::vec3>& steering, const std::vector<FlockSums>& sums, const std::vector<glm::vec3>& wind, float dt);
+
+#endif
@@ -4,9 +4,20 @@
 #include "boid.h"
 #include "obstaclepoint.h"
 #include "obstacleplane.h"
+#include "spatial_hash.hpp"
+#include "flow_field.hpp"
+#include "flock.hpp"
 #include <glm/glm.hpp>
 #include <vector>
 
+const float ROOM_SIZE = 550.0f;
+
+// Levels where boids leaving one side of the world come back on the other
+bool getLevelPeriodic(int level)
+{
+	return level == 3;
+}
+
 
 std::vector<ObstaclePlane> getLevelWalls(int level)
 {
@@ -14,20 +25,62 @@ std::vector<ObstaclePlane> getLevelWalls(int level)
 
 	switch (level)
 	{
+	case 2: // open world, no walls
+	case 3: // periodic world, no walls needed
+		break;
 	default: 
-		walls = getWalls(550.0f);
+		walls = getWalls(ROOM_SIZE);
 		break;
 	}
 
 	return walls;
 }
 
+// OBJ file with the level's static geometry, null if it has none
+const char* getLevelMesh(int level)
+{
+	switch (level)
+	{
+	case 6: // pillars and beams in the room
+		return "pillars.obj";
+	default:
+		return nullptr;
+	}
+}
+
+// Places the flock finds its way to around the level's obstacles
+std::vector<Goal> getLevelGoals(int level)
+{
+	std::vector<Goal> goals;
+
+	switch (level)
+	{
+	case 6: // a corner behind the pillars, slowly moving along the wall
+		goals.push_back(Goal(glm::vec3(-230, 0, -230), glm::vec3(0.05f, 0, 0)));
+		break;
+	default:
+		break;
+	}
+
+	return goals;
+}
+
 std::vector<Boid> getLevelBoids(int level, int nrBoids)
 {
 	std::vector<Boid> boids;
 
 	switch (level)
 	{
+	case 3: // spread evenly over the whole periodic world
+		for (int i = 0; i < nrBoids; ++i)
+		boids.push_back(Boid((int)WORLD_SIZE));
+		break;
+	case 7: // a flock with one predator per hundred prey around it, each species kept together
+		for (int i = 0; i < nrBoids - nrBoids / 100; ++i)
+		boids.push_back(Boid(100, glm::vec3(0, 0, 0)));
+		for (int i = 0; i < nrBoids / 100; ++i)
+		boids.push_back(Boid(300, glm::vec3(0, 0, 0), PREDATOR));
+		break;
 	default:
 		for (int i = 0; i < nrBoids; ++i)
 		boids.push_back(Boid(100, glm::vec3(0, 0, 0)));
@@ -37,12 +90,59 @@ std::vector<Boid> getLevelBoids(int level, int nrBoids)
 	return boids;
 }
 
+// Gives some boids parameters of their own, after the parameters have been reset to those of each boid's species
+void setLevelParameters(int level, ParameterColumns& parameters)
+{
+	switch (level)
+	{
+	case 7: // no two prey quite alike, up to 10% faster or slower and keeping more or less distance
+		for (uint32_t i = 0; i < boids.size(); ++i)
+		{
+			if (boids[i].species != PREY)
+				continue;
+			SteeringParameters p = parameters.get(i);
+			p.maxSpeed *= 0.9f + (rand() % 201) / 1000.0f;
+			p.separation *= 0.75f + (rand() % 501) / 1000.0f;
+			parameters.set(i, p);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
 std::vector<ObstaclePoint> getLevelObjects(int level)
 {
 	std::vector<ObstaclePoint> objects;
 
 	switch (level)
 	{
+	case 2: // migration towards a point far away
+		objects.push_back(ObstaclePoint(5000, 0, 2000, true));
+		break;
+	case 3: // nothing but boids
+		break;
+	case 4: // the room full of short range points, some of them drifting around
+		objects.push_back(ObstaclePoint(0, 0, 0, true));
+		for (int i = 0; i < 20000; ++i) {
+			glm::vec3 p(rand() % (int)ROOM_SIZE - ROOM_SIZE / 2, rand() % (int)ROOM_SIZE - ROOM_SIZE / 2, rand() % (int)ROOM_SIZE - ROOM_SIZE / 2);
+			glm::vec3 v(0.0f);
+			if (i % 10 == 0) {
+				v = glm::vec3(rand() % 21 - 10, rand() % 21 - 10, rand() % 21 - 10) * 0.01f;
+			}
+			objects.push_back(ObstaclePoint(p.x, p.y, p.z, i % 4 == 0, 10.0f + rand() % 20, v));
+		}
+		break;
+	case 5: // thousands of long range points in clouds outside the room, some drifting along the row of clouds
+		for (int i = 0; i < 5000; ++i) {
+			glm::vec3 cloud(i % 5 * 1000.0f - 2000.0f, 0.0f, 3000.0f);
+			glm::vec3 v = (i % 100 == 0) ? glm::vec3(0.5f, 0.0f, 0.0f) : glm::vec3(0.0f);
+			ObstaclePoint o(cloud.x + rand() % 401 - 200, cloud.y + rand() % 401 - 200, cloud.z + rand() % 401 - 200, i % 3 != 0, 0.0f, v);
+			o.regionLo = glm::vec3(-2200.0f, -200.0f, 2800.0f);
+			o.regionHi = glm::vec3(2200.0f, 200.0f, 3200.0f);
+			objects.push_back(o);
+		}
+		break;
 	default:
 		objects.push_back(ObstaclePoint(100, 0, 0, true));
 		objects.push_back(ObstaclePoint(-100, 0, 0, false));
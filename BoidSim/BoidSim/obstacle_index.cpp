@@ -0,0 +1,327 @@
+#include "obstacle_index.hpp"
+#include "spatial_hash.hpp"
+#include <algorithm>
+
+const uint32_t OBSTACLE_BUCKETS = 1 << 16; // power of two, cells that share a bucket only cost some extra distance checks
+
+// What a bucket needs to know about a point, copied in so a lookup reads one contiguous range
+struct ObstacleEntry {
+	glm::vec3 position;
+	float sign; // -1 attracts, 1 repels
+	float rangeSquared;
+};
+
+// Points with a range, stored in every cell their range overlaps. The cells are as big as the largest range,
+// so a point is in at most 3x3x3 cells and a boid only has to look in its own
+struct ObstacleIndex {
+	float cellSize = 1.0f;
+	std::vector<uint32_t> bucketStart; // OBSTACLE_BUCKETS + 1 offsets into entries
+	std::vector<ObstacleEntry> entries;
+	std::vector<ObstacleEntry> copies; // while building
+	std::vector<std::pair<uint32_t, uint32_t>> placed; // (bucket, copy) while building
+
+	void build(const std::vector<ObstaclePoint>& points, bool moving);
+	void addForce(const glm::vec3& position, glm::vec3& force, uint32_t& count) const;
+	bool reaches(const glm::vec3& position) const;
+};
+
+ObstacleIndex staticIndex, movingIndex;
+
+// Points without a range in an octree, a node far enough away acts as one point per sign at the centre of its points
+const uint32_t POINT_LEAF_SIZE = 8;
+float pointOpeningAngle = 0.5f;
+std::atomic<float> pointForceError(0.0f);
+
+struct PointCluster {
+	float count = 0.0f;
+	glm::vec3 centre = glm::vec3(0.0f);
+	float radius = 0.0f; // distance from the centre to its furthest point
+};
+
+struct PointNode {
+	glm::vec3 centre; // of the box
+	float halfSize;
+	PointCluster clusters[2]; // attracting, repelling
+	uint32_t begin, end; // its points in longRange
+	bool leaf;
+	int children[8];
+};
+
+std::vector<ObstacleEntry> longRange; // ordered so every node's points are contiguous
+std::vector<PointNode> pointTree;
+
+uint32_t getObstacleBucket(int x, int y, int z) {
+	return ((uint32_t)x * 73856093u ^ (uint32_t)y * 19349663u ^ (uint32_t)z * 83492791u) & (OBSTACLE_BUCKETS - 1);
+}
+
+ObstacleEntry getEntry(const ObstaclePoint& o) {
+	return ObstacleEntry{ o.position, o.attractive ? -1.0f : 1.0f, o.range * o.range };
+}
+
+void ObstacleIndex::build(const std::vector<ObstaclePoint>& points, bool moving) {
+	cellSize = 1.0f;
+	for (const ObstaclePoint& o : points) {
+		if (o.range > 0.0f && (o.velocity != glm::vec3(0.0f)) == moving) {
+			cellSize = std::max(cellSize, o.range);
+		}
+	}
+
+	placed.clear();
+	copies.clear();
+	for (const ObstaclePoint& o : points) {
+		if (o.range <= 0.0f || (o.velocity != glm::vec3(0.0f)) != moving) {
+			continue;
+		}
+		// in a periodic world a point near an edge also reaches boids on the other side, so it gets a shifted copy there
+		int shifts[3][3], nrShifts[3];
+		for (int a = 0; a < 3; a++) {
+			nrShifts[a] = 0;
+			shifts[a][nrShifts[a]++] = 0;
+			if (periodicWorld && o.position[a] - o.range < -WORLD_SIZE / 2) shifts[a][nrShifts[a]++] = 1;
+			if (periodicWorld && o.position[a] + o.range >= WORLD_SIZE / 2) shifts[a][nrShifts[a]++] = -1;
+		}
+		for (int sz = 0; sz < nrShifts[2]; sz++)
+			for (int sy = 0; sy < nrShifts[1]; sy++)
+				for (int sx = 0; sx < nrShifts[0]; sx++) {
+					ObstacleEntry e = getEntry(o);
+					e.position += glm::vec3(shifts[0][sx], shifts[1][sy], shifts[2][sz]) * WORLD_SIZE;
+					uint32_t c = (uint32_t)copies.size();
+					copies.push_back(e);
+
+					glm::vec3 lo = glm::floor((e.position - o.range) / cellSize);
+					glm::vec3 hi = glm::floor((e.position + o.range) / cellSize);
+					size_t first = placed.size();
+					for (int z = (int)lo.z; z <= (int)hi.z; z++)
+						for (int y = (int)lo.y; y <= (int)hi.y; y++)
+							for (int x = (int)lo.x; x <= (int)hi.x; x++)
+								placed.push_back({ getObstacleBucket(x, y, z), c });
+					// two cells of the same point can end up in one bucket, it must only be counted once there
+					std::sort(placed.begin() + first, placed.end());
+					placed.erase(std::unique(placed.begin() + first, placed.end()), placed.end());
+				}
+	}
+
+	// counting sort into the buckets
+	bucketStart.assign(OBSTACLE_BUCKETS + 1, 0);
+	for (const auto& p : placed) {
+		bucketStart[p.first + 1]++;
+	}
+	for (uint32_t b = 0; b < OBSTACLE_BUCKETS; b++) {
+		bucketStart[b + 1] += bucketStart[b];
+	}
+	entries.resize(placed.size());
+	std::vector<uint32_t> next(bucketStart.begin(), bucketStart.end() - 1);
+	for (const auto& p : placed) {
+		entries[next[p.first]++] = copies[p.second];
+	}
+}
+
+void ObstacleIndex::addForce(const glm::vec3& position, glm::vec3& force, uint32_t& count) const {
+	if (entries.empty()) {
+		return;
+	}
+	glm::vec3 cell = glm::floor(position / cellSize);
+	uint32_t bucket = getObstacleBucket((int)cell.x, (int)cell.y, (int)cell.z);
+	for (uint32_t e = bucketStart[bucket]; e < bucketStart[bucket + 1]; e++) {
+		const ObstacleEntry& o = entries[e];
+		glm::vec3 offset = position - o.position;
+		float d2 = glm::dot(offset, offset);
+		if (d2 < o.rangeSquared && d2 > 0.0f) {
+			force += offset * (o.sign / d2);
+			count++;
+		}
+	}
+}
+
+bool ObstacleIndex::reaches(const glm::vec3& position) const {
+	if (entries.empty()) {
+		return false;
+	}
+	glm::vec3 cell = glm::floor(position / cellSize);
+	uint32_t bucket = getObstacleBucket((int)cell.x, (int)cell.y, (int)cell.z);
+	for (uint32_t e = bucketStart[bucket]; e < bucketStart[bucket + 1]; e++) {
+		glm::vec3 offset = position - entries[e].position;
+		if (glm::dot(offset, offset) < entries[e].rangeSquared) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int buildPointNode(uint32_t begin, uint32_t end, glm::vec3 centre, float halfSize) {
+	int n = (int)pointTree.size();
+	pointTree.push_back(PointNode());
+	PointNode node;
+	node.centre = centre;
+	node.halfSize = halfSize;
+	node.begin = begin;
+	node.end = end;
+	node.leaf = true;
+	std::fill(node.children, node.children + 8, -1);
+
+	for (uint32_t i = begin; i < end; i++) {
+		PointCluster& c = node.clusters[longRange[i].sign > 0.0f];
+		c.count += 1.0f;
+		c.centre += longRange[i].position;
+	}
+	for (PointCluster& c : node.clusters) {
+		if (c.count > 0.0f) {
+			c.centre *= 1.0f / c.count;
+		}
+	}
+	for (uint32_t i = begin; i < end; i++) {
+		PointCluster& c = node.clusters[longRange[i].sign > 0.0f];
+		c.radius = std::max(c.radius, glm::length(longRange[i].position - c.centre));
+	}
+
+	// split into octants, unless it is small enough or all points are in the same spot
+	if (end - begin > POINT_LEAF_SIZE && halfSize > 0.001f) {
+		node.leaf = false;
+		uint32_t octantEnd[8];
+		uint32_t first = begin;
+		for (int o = 0; o < 8; o++) {
+			auto inOctant = [&](const ObstacleEntry& e) {
+				return (e.position.x >= centre.x) == (bool)(o & 1) && (e.position.y >= centre.y) == (bool)(o & 2) && (e.position.z >= centre.z) == (bool)(o & 4);
+			};
+			first = (uint32_t)(std::partition(longRange.begin() + first, longRange.begin() + end, inOctant) - longRange.begin());
+			octantEnd[o] = first;
+		}
+		uint32_t from = begin;
+		for (int o = 0; o < 8; o++) {
+			if (octantEnd[o] > from) {
+				glm::vec3 childCentre = centre + glm::vec3(o & 1 ? 0.5f : -0.5f, o & 2 ? 0.5f : -0.5f, o & 4 ? 0.5f : -0.5f) * halfSize;
+				node.children[o] = buildPointNode(from, octantEnd[o], childCentre, halfSize * 0.5f);
+			}
+			from = octantEnd[o];
+		}
+	}
+	pointTree[n] = node;
+	return n;
+}
+
+void buildPointTree(const std::vector<ObstaclePoint>& points) {
+	longRange.clear();
+	pointTree.clear();
+	glm::vec3 lo(0.0f), hi(0.0f);
+	for (const ObstaclePoint& o : points) {
+		if (o.range <= 0.0f) {
+			if (longRange.empty()) {
+				lo = hi = o.position;
+			}
+			longRange.push_back(getEntry(o));
+			lo = glm::min(lo, o.position);
+			hi = glm::max(hi, o.position);
+		}
+	}
+	if (!longRange.empty()) {
+		glm::vec3 size = hi - lo;
+		buildPointNode(0, (uint32_t)longRange.size(), (lo + hi) * 0.5f, std::max(std::max(size.x, size.y), size.z) * 0.5f);
+	}
+}
+
+// Opens the node if it is too close, otherwise adds it as one point per sign. Expanded around the centre of its points
+// the next term of the error is second order, and the force (offset/d^2) has a second derivative of at most 2/d^3,
+// so the error from a cluster is at most count * radius^2 / (d - radius)^3
+void addPointNode(const PointNode& node, const glm::vec3& position, glm::vec3& force, float& error) {
+	bool far = !node.leaf; // leaves are cheap enough to add exactly
+	glm::vec3 offsets[2];
+	for (int c = 0; c < 2 && far; c++) {
+		const PointCluster& cluster = node.clusters[c];
+		if (cluster.count == 0.0f) {
+			continue;
+		}
+		offsets[c] = wrapOffset(position - cluster.centre);
+		float d = glm::length(offsets[c]);
+		far = d > cluster.radius && 2.0f * node.halfSize < pointOpeningAngle * d;
+		// in a periodic world all points of the cluster must have the same closest image
+		for (int a = 0; a < 3 && far && periodicWorld; a++) {
+			far = std::abs(offsets[c][a]) + cluster.radius < WORLD_SIZE / 2;
+		}
+	}
+
+	if (far) {
+		for (int c = 0; c < 2; c++) {
+			const PointCluster& cluster = node.clusters[c];
+			if (cluster.count > 0.0f) {
+				float d2 = glm::dot(offsets[c], offsets[c]);
+				force += offsets[c] * ((c ? 1.0f : -1.0f) * cluster.count / d2);
+				float gap = std::sqrt(d2) - cluster.radius;
+				error += cluster.count * cluster.radius * cluster.radius / (gap * gap * gap);
+			}
+		}
+	}
+	else if (node.leaf) {
+		for (uint32_t i = node.begin; i < node.end; i++) {
+			glm::vec3 offset = wrapOffset(position - longRange[i].position);
+			force += offset * (longRange[i].sign / glm::dot(offset, offset));
+		}
+	}
+	else {
+		for (int child : node.children) {
+			if (child >= 0) {
+				addPointNode(pointTree[child], position, force, error);
+			}
+		}
+	}
+}
+
+void indexObstacles(const std::vector<ObstaclePoint>& points) {
+	buildPointTree(points);
+	staticIndex.build(points, false);
+	movingIndex.build(points, true);
+}
+
+void moveObstacles(std::vector<ObstaclePoint>& points, float halfSize, float dt) {
+	pointForceError = 0.0f;
+	bool moving = false, moved = false;
+	for (ObstaclePoint& o : points) {
+		if (o.velocity == glm::vec3(0.0f)) {
+			continue;
+		}
+		moving = true;
+		o.position += o.velocity * dt;
+		if (periodicWorld) {
+			o.position = wrapPosition(o.position);
+		}
+		else {
+			bool ownRegion = o.regionLo.x <= o.regionHi.x;
+			glm::vec3 lo = ownRegion ? o.regionLo : glm::vec3(-halfSize);
+			glm::vec3 hi = ownRegion ? o.regionHi : glm::vec3(halfSize);
+			for (int a = 0; a < 3; a++) {
+				if (o.position[a] < lo[a] || o.position[a] > hi[a]) {
+					o.velocity[a] = -o.velocity[a];
+					o.position[a] = glm::clamp(o.position[a], lo[a], hi[a]);
+				}
+			}
+		}
+		moved = moved || o.range <= 0.0f;
+	}
+	if (moved) {
+		buildPointTree(points);
+	}
+	if (moving) {
+		movingIndex.build(points, true);
+	}
+}
+
+bool hasObstaclePoints() {
+	return !longRange.empty() || !staticIndex.entries.empty() || !movingIndex.entries.empty();
+}
+
+bool isInPointRange(const glm::vec3& position) {
+	return staticIndex.reaches(position) || movingIndex.reaches(position);
+}
+
+uint32_t getObstacleForce(const glm::vec3& position, glm::vec3& force) {
+	uint32_t count = (uint32_t)longRange.size();
+	if (!pointTree.empty()) {
+		float error = 0.0f;
+		addPointNode(pointTree[0], position, force, error);
+		// steering threads can get here at the same time
+		float largest = pointForceError.load();
+		while (error > largest && !pointForceError.compare_exchange_weak(largest, error)) {}
+	}
+	staticIndex.addForce(position, force, count);
+	movingIndex.addForce(position, force, count);
+	return count;
+}
@@ -0,0 +1,30 @@
+#ifndef obstacle_index_hpp
+#define obstacle_index_hpp
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+#include "obstaclepoint.h"
+
+// The points without a range are kept in an octree, a part of it that is small seen from the boid (size/distance below
+// pointOpeningAngle) acts as one attracting and one repelling point. 0 adds every point exactly
+extern float pointOpeningAngle;
+// Largest bound on the error of the long range force of any boid since the last moveObstacles
+extern std::atomic<float> pointForceError;
+
+// Indexes all points, call when the level is loaded. Points with a range are bucketed in a grid of their own so a boid
+// only looks at the ones that can reach it, the ones without a range act on every boid
+void indexObstacles(const std::vector<ObstaclePoint>& points);
+// Moves the moving points by dt times their velocity, bouncing them inside their region, or a box of the given half size
+// if they have none (or wrapping them in a periodic world), and re-indexes only those
+void moveObstacles(std::vector<ObstaclePoint>& points, float halfSize, float dt);
+// Adds the force from every point acting on a boid at position, returns how many points that was
+uint32_t getObstacleForce(const glm::vec3& position, glm::vec3& force);
+// Whether any point has been indexed, i.e. whether getObstacleForce can add anything
+bool hasObstaclePoints();
+// Whether a point with a range, moving or not, reaches position. The points without a range reach everywhere and are
+// not counted
+bool isInPointRange(const glm::vec3& position);
+
+#endif
@@ -0,0 +1,323 @@
+#include "obstacle_mesh.hpp"
+#include <algorithm>
+#include <cfloat>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+const uint32_t MESH_LEAF_SIZE = 4;
+const int SAH_BINS = 12;
+const float SAH_TRAVERSAL_COST = 1.0f; // relative to one triangle test
+
+// Stored the way the intersection test wants them
+struct MeshTriangle {
+	glm::vec3 v0, e1, e2;
+};
+
+// Children of an inner node are the next node and the node at start, a leaf has its triangles at start
+struct BVHNode {
+	glm::vec3 lo, hi;
+	uint32_t start, count; // count is 0 for an inner node
+	int axis; // split axis, to visit the nearer child first
+};
+
+std::vector<MeshTriangle> meshTriangles;
+std::vector<BVHNode> bvh;
+
+// while building
+struct BuildTriangle {
+	glm::vec3 lo, hi, centre;
+	uint32_t index;
+};
+std::vector<BuildTriangle> buildTriangles;
+
+float getArea(const glm::vec3& lo, const glm::vec3& hi) {
+	glm::vec3 d = glm::max(hi - lo, glm::vec3(0.0f));
+	return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+// Splits at the cheapest bin boundary on any axis by the surface area heuristic, or makes a leaf if that is cheaper
+uint32_t buildNode(uint32_t begin, uint32_t end) {
+	uint32_t n = (uint32_t)bvh.size();
+	bvh.push_back(BVHNode());
+	BVHNode node;
+	node.lo = glm::vec3(FLT_MAX);
+	node.hi = glm::vec3(-FLT_MAX);
+	glm::vec3 centreLo(FLT_MAX), centreHi(-FLT_MAX);
+	for (uint32_t i = begin; i < end; i++) {
+		node.lo = glm::min(node.lo, buildTriangles[i].lo);
+		node.hi = glm::max(node.hi, buildTriangles[i].hi);
+		centreLo = glm::min(centreLo, buildTriangles[i].centre);
+		centreHi = glm::max(centreHi, buildTriangles[i].centre);
+	}
+	node.start = begin;
+	node.count = end - begin;
+	node.axis = 0;
+
+	float bestCost = (float)(end - begin); // as a leaf
+	int bestAxis = -1, bestSplit = 0;
+	if (end - begin > MESH_LEAF_SIZE) {
+		for (int axis = 0; axis < 3; axis++) {
+			float extent = centreHi[axis] - centreLo[axis];
+			if (extent <= 0.0f) {
+				continue;
+			}
+			glm::vec3 binLo[SAH_BINS], binHi[SAH_BINS];
+			uint32_t binCount[SAH_BINS] = {};
+			std::fill(binLo, binLo + SAH_BINS, glm::vec3(FLT_MAX));
+			std::fill(binHi, binHi + SAH_BINS, glm::vec3(-FLT_MAX));
+			for (uint32_t i = begin; i < end; i++) {
+				int b = std::min((int)((buildTriangles[i].centre[axis] - centreLo[axis]) / extent * SAH_BINS), SAH_BINS - 1);
+				binCount[b]++;
+				binLo[b] = glm::min(binLo[b], buildTriangles[i].lo);
+				binHi[b] = glm::max(binHi[b], buildTriangles[i].hi);
+			}
+			// areas of everything right of each boundary, then sweep from the left
+			float rightArea[SAH_BINS];
+			uint32_t rightCount[SAH_BINS];
+			glm::vec3 lo(FLT_MAX), hi(-FLT_MAX);
+			uint32_t count = 0;
+			for (int b = SAH_BINS - 1; b > 0; b--) {
+				lo = glm::min(lo, binLo[b]);
+				hi = glm::max(hi, binHi[b]);
+				count += binCount[b];
+				rightArea[b] = getArea(lo, hi);
+				rightCount[b] = count;
+			}
+			lo = glm::vec3(FLT_MAX);
+			hi = glm::vec3(-FLT_MAX);
+			count = 0;
+			float parentArea = getArea(node.lo, node.hi);
+			for (int b = 1; b < SAH_BINS; b++) {
+				lo = glm::min(lo, binLo[b - 1]);
+				hi = glm::max(hi, binHi[b - 1]);
+				count += binCount[b - 1];
+				if (count == 0 || rightCount[b] == 0) {
+					continue;
+				}
+				float cost = SAH_TRAVERSAL_COST + (getArea(lo, hi) * count + rightArea[b] * rightCount[b]) / parentArea;
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = b;
+				}
+			}
+		}
+	}
+
+	if (bestAxis >= 0) {
+		float extent = centreHi[bestAxis] - centreLo[bestAxis];
+		auto left = [&](const BuildTriangle& t) {
+			return std::min((int)((t.centre[bestAxis] - centreLo[bestAxis]) / extent * SAH_BINS), SAH_BINS - 1) < bestSplit;
+		};
+		uint32_t middle = (uint32_t)(std::partition(buildTriangles.begin() + begin, buildTriangles.begin() + end, left) - buildTriangles.begin());
+		node.count = 0;
+		node.axis = bestAxis;
+		buildNode(begin, middle);
+		node.start = buildNode(middle, end);
+	}
+	bvh[n] = node;
+	return n;
+}
+
+bool loadObstacleMesh(const char* path) {
+	meshTriangles.clear();
+	bvh.clear();
+	if (path == nullptr) {
+		return true;
+	}
+	std::ifstream file(path);
+	if (!file) {
+		std::cout << "Failed to load mesh: " << path << std::endl;
+		return false;
+	}
+
+	// only vertices and faces are used, faces with more than three corners are split into a fan
+	std::vector<glm::vec3> vertices;
+	std::string line;
+	while (std::getline(file, line)) {
+		std::istringstream in(line);
+		std::string type;
+		in >> type;
+		if (type == "v") {
+			glm::vec3 v;
+			in >> v.x >> v.y >> v.z;
+			vertices.push_back(v);
+		}
+		else if (type == "f") {
+			std::vector<glm::vec3> corners;
+			std::string corner;
+			while (in >> corner) {
+				// the vertex index, up to the first '/' if there are texture coordinates or normals
+				char* end;
+				long i = std::strtol(corner.c_str(), &end, 10);
+				bool number = end != corner.c_str() && (*end == '\0' || *end == '/');
+				i = i < 0 ? (long)vertices.size() + i : i - 1;
+				if (!number || i < 0 || i >= (long)vertices.size()) {
+					std::cout << "Bad face in mesh: " << path << std::endl;
+					return false;
+				}
+				corners.push_back(vertices[i]);
+			}
+			for (size_t c = 2; c < corners.size(); c++) {
+				meshTriangles.push_back(MeshTriangle{ corners[0], corners[c - 1] - corners[0], corners[c] - corners[0] });
+			}
+		}
+	}
+
+	buildTriangles.resize(meshTriangles.size());
+	for (uint32_t i = 0; i < meshTriangles.size(); i++) {
+		const MeshTriangle& t = meshTriangles[i];
+		BuildTriangle& b = buildTriangles[i];
+		b.lo = glm::min(t.v0, glm::min(t.v0 + t.e1, t.v0 + t.e2));
+		b.hi = glm::max(t.v0, glm::max(t.v0 + t.e1, t.v0 + t.e2));
+		b.centre = (b.lo + b.hi) * 0.5f;
+		b.index = i;
+	}
+	if (!meshTriangles.empty()) {
+		buildNode(0, (uint32_t)meshTriangles.size());
+	}
+	// put the triangles in leaf order
+	std::vector<MeshTriangle> ordered(meshTriangles.size());
+	for (uint32_t i = 0; i < ordered.size(); i++) {
+		ordered[i] = meshTriangles[buildTriangles[i].index];
+	}
+	meshTriangles.swap(ordered);
+	buildTriangles.clear();
+	return true;
+}
+
+bool hasObstacleMesh() {
+	return !bvh.empty();
+}
+
+bool boxesOverlap(const glm::vec3& lo1, const glm::vec3& hi1, const glm::vec3& lo2, const glm::vec3& hi2) {
+	return lo1.x <= hi2.x && lo2.x <= hi1.x && lo1.y <= hi2.y && lo2.y <= hi1.y && lo1.z <= hi2.z && lo2.z <= hi1.z;
+}
+
+bool meshOverlapsBox(const glm::vec3& lo, const glm::vec3& hi) {
+	thread_local std::vector<uint32_t> stack;
+	stack.clear();
+	if (!bvh.empty()) {
+		stack.push_back(0);
+	}
+	while (!stack.empty()) {
+		uint32_t n = stack.back();
+		stack.pop_back();
+		const BVHNode& node = bvh[n];
+		if (!boxesOverlap(node.lo, node.hi, lo, hi)) {
+			continue;
+		}
+		if (node.count == 0) {
+			stack.push_back(n + 1);
+			stack.push_back(node.start);
+			continue;
+		}
+		for (uint32_t i = node.start; i < node.start + node.count; i++) {
+			const MeshTriangle& t = meshTriangles[i];
+			glm::vec3 a = t.v0, b = t.v0 + t.e1, c = t.v0 + t.e2;
+			if (boxesOverlap(glm::min(a, glm::min(b, c)), glm::max(a, glm::max(b, c)), lo, hi)) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// while casting
+struct Ray {
+	glm::vec3 origin, direction, inverse;
+};
+thread_local std::vector<Ray> rays; // per thread, cells are steered in parallel
+thread_local std::vector<uint32_t> active; // used as a stack, each node gets the rays that hit its box on top
+
+bool hitsBox(const Ray& r, const BVHNode& node, float maxDistance) {
+	glm::vec3 t0 = (node.lo - r.origin) * r.inverse;
+	glm::vec3 t1 = (node.hi - r.origin) * r.inverse;
+	glm::vec3 near = glm::min(t0, t1), far = glm::max(t0, t1);
+	float enter = std::max(std::max(near.x, near.y), std::max(near.z, 0.0f));
+	float leave = std::min(std::min(far.x, far.y), std::min(far.z, maxDistance));
+	return enter <= leave;
+}
+
+void castNode(uint32_t n, size_t begin, std::vector<MeshHit>& hits) {
+	const BVHNode& node = bvh[n];
+	size_t end = active.size();
+	for (size_t a = begin; a < end; a++) {
+		uint32_t r = active[a];
+		if (hitsBox(rays[r], node, hits[r].distance)) {
+			active.push_back(r);
+		}
+	}
+	if (active.size() == end) {
+		return;
+	}
+
+	if (node.count > 0) {
+		for (size_t a = end; a < active.size(); a++) {
+			uint32_t r = active[a];
+			const Ray& ray = rays[r];
+			for (uint32_t i = node.start; i < node.start + node.count; i++) { // Moller-Trumbore
+				const MeshTriangle& t = meshTriangles[i];
+				glm::vec3 p = glm::cross(ray.direction, t.e2);
+				float det = glm::dot(t.e1, p);
+				if (std::abs(det) < 1e-8f) {
+					continue;
+				}
+				float inv = 1.0f / det;
+				glm::vec3 s = ray.origin - t.v0;
+				float u = glm::dot(s, p) * inv;
+				if (u < 0.0f || u > 1.0f) {
+					continue;
+				}
+				glm::vec3 q = glm::cross(s, t.e1);
+				float v = glm::dot(ray.direction, q) * inv;
+				if (v < 0.0f || u + v > 1.0f) {
+					continue;
+				}
+				float d = glm::dot(t.e2, q) * inv;
+				if (d >= 0.0f && d < hits[r].distance) {
+					glm::vec3 normal = glm::normalize(glm::cross(t.e1, t.e2));
+					hits[r].distance = d;
+					hits[r].normal = glm::dot(normal, ray.direction) > 0.0f ? -normal : normal;
+				}
+			}
+		}
+	}
+	else {
+		// the child on the side the rays come from first, so its hits can cut the second one short
+		uint32_t first = n + 1, second = node.start;
+		if (rays[active[end]].direction[node.axis] < 0.0f) {
+			std::swap(first, second);
+		}
+		castNode(first, end, hits);
+		castNode(second, end, hits);
+	}
+	active.resize(end);
+}
+
+void castRays(const std::vector<glm::vec3>& origins, const std::vector<glm::vec3>& directions, float maxDistance, std::vector<MeshHit>& hits) {
+	hits.assign(origins.size(), MeshHit{ FLT_MAX, glm::vec3(0.0f) });
+	if (bvh.empty()) {
+		return;
+	}
+	rays.resize(origins.size());
+	active.clear();
+	for (uint32_t r = 0; r < origins.size(); r++) {
+		rays[r].origin = origins[r];
+		rays[r].direction = directions[r];
+		rays[r].inverse = 1.0f / directions[r]; // infinities are fine for the slab test
+		if (directions[r] != glm::vec3(0.0f)) {
+			hits[r].distance = maxDistance;
+			active.push_back(r);
+		}
+	}
+	castNode(0, 0, hits);
+	for (MeshHit& hit : hits) {
+		if (hit.distance >= maxDistance) {
+			hit.distance = FLT_MAX;
+		}
+	}
+}
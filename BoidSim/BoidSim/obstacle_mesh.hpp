@@ -0,0 +1,25 @@
+#ifndef obstacle_mesh_hpp
+#define obstacle_mesh_hpp
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+
+// Where a look-ahead ray first hits a mesh
+struct MeshHit {
+	float distance; // larger than the cast distance if nothing was hit
+	glm::vec3 normal; // facing the ray
+};
+
+// Loads the triangles of an OBJ file as static obstacles and builds a BVH over them, replacing any earlier mesh.
+// A null path just removes the mesh
+bool loadObstacleMesh(const char* path);
+bool hasObstacleMesh();
+// Whether a mesh triangle might be in the box, it is enough that the triangle's bounding box overlaps it
+bool meshOverlapsBox(const glm::vec3& lo, const glm::vec3& hi);
+// Casts a group of rays, e.g. those of the boids in one cell, through the BVH together. A node is visited once for all
+// the rays that can still hit it, so rays that start close together and point the same way share most of the work.
+// Directions must be normalized, a ray with a zero direction never hits
+void castRays(const std::vector<glm::vec3>& origins, const std::vector<glm::vec3>& directions, float maxDistance, std::vector<MeshHit>& hits);
+
+#endif
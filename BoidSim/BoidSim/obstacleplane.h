@@ -11,7 +11,7 @@ struct ObstaclePlane {
 		: point(p1, p2, p3), normal(n1, n2, n3) {}
 };
 
-std::vector<ObstaclePlane> getWalls(float roomSize) {
+inline std::vector<ObstaclePlane> getWalls(float roomSize) {
 	std::vector<ObstaclePlane> walls;
 	float s = roomSize/2.0f;
 
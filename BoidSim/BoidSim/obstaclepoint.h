@@ -6,10 +6,13 @@
 
 struct ObstaclePoint {
 	glm::vec3 position;
+	glm::vec3 velocity; // zero for points that stand still
 	bool attractive;
+	float range; // boids further away are not affected, 0 means it reaches everywhere
+	glm::vec3 regionLo, regionHi; // box a moving point bounces in, the room if lo > hi
 
-	ObstaclePoint(float p1, float p2, float p3, bool attract)
-		: position(p1, p2, p3), attractive(attract) {}
+	ObstaclePoint(float p1, float p2, float p3, bool attract, float r = 0.0f, glm::vec3 v = glm::vec3(0.0f))
+		: position(p1, p2, p3), velocity(v), attractive(attract), range(r), regionLo(1.0f), regionHi(-1.0f) {}
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,124 @@
+#include "parallel.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+const int MAX_THREADS = 64;
+int steerThreads = std::min((int)std::max(1u, std::thread::hardware_concurrency()), MAX_THREADS);
+bool deterministicMode = false;
+
+const uint32_t REDUCTION_BLOCK = 256;
+
+// Helper threads are started the first time they are needed and then wait for work, so a step does not pay for
+// creating and joining threads. A job hands out its chunks in the same way whichever threads take part
+struct WorkerPool {
+	std::vector<std::thread> helpers;
+	std::mutex mutex;
+	std::condition_variable wake, finished;
+	const std::function<void(uint32_t, uint32_t)>* work;
+	uint32_t count, chunk, chunks;
+	std::atomic<uint32_t> next;
+	uint64_t job; // counts the jobs, so that a helper does not take one twice
+	int joining; // helpers 0 to joining-1 take part in the current job
+	int busy; // of those, the ones that have not finished it yet
+	bool stopping;
+	WorkerPool() : work(NULL), count(0), chunk(1), chunks(0), next(0), job(0), joining(0), busy(0), stopping(false) {}
+
+	~WorkerPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (std::thread& helper : helpers) {
+			helper.join();
+		}
+	}
+
+	// threads take the next chunk when they are done with one, so a slow chunk does not hold the others up
+	void runChunks() {
+		for (uint32_t c = next++; c < chunks; c = next++) {
+			(*work)(c * chunk, std::min((c + 1) * chunk, count));
+		}
+	}
+
+	void helperLoop(int id) {
+		uint64_t done = 0;
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			wake.wait(lock, [&]() { return stopping || (job != done && id < joining); });
+			if (stopping) {
+				return;
+			}
+			done = job;
+			lock.unlock();
+			runChunks();
+			lock.lock();
+			if (--busy == 0) {
+				finished.notify_one();
+			}
+		}
+	}
+
+	// Not reentrant, work must not call parallelFor itself
+	void run(uint32_t n, uint32_t size, int threads, const std::function<void(uint32_t, uint32_t)>& w) {
+		while ((int)helpers.size() < threads - 1) {
+			int id = helpers.size();
+			helpers.emplace_back([this, id]() { helperLoop(id); });
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			work = &w;
+			count = n;
+			chunk = size;
+			chunks = (n + size - 1) / size;
+			next = 0;
+			joining = busy = threads - 1;
+			job++;
+		}
+		wake.notify_all();
+		runChunks();
+		std::unique_lock<std::mutex> lock(mutex);
+		finished.wait(lock, [&]() { return busy == 0; });
+		work = NULL;
+	}
+};
+WorkerPool workerPool;
+
+void parallelFor(uint32_t count, uint32_t chunk, const std::function<void(uint32_t, uint32_t)>& work) {
+	uint32_t chunks = (count + chunk - 1) / chunk;
+	int threads = (int)std::min<uint32_t>(glm::clamp(steerThreads, 1, MAX_THREADS), chunks);
+	if (threads <= 1) {
+		for (uint32_t begin = 0; begin < count; begin += chunk) {
+			work(begin, std::min(begin + chunk, count));
+		}
+		return;
+	}
+	workerPool.run(count, chunk, threads, work);
+}
+
+glm::vec3 treeSum(const std::vector<glm::vec3>& values) {
+	std::vector<glm::vec3> sums;
+	for (size_t begin = 0; begin < values.size(); begin += REDUCTION_BLOCK) {
+		glm::vec3 sum(0.0f);
+		for (size_t i = begin; i < std::min(begin + REDUCTION_BLOCK, values.size()); i++) {
+			sum += values[i];
+		}
+		sums.push_back(sum);
+	}
+	if (sums.empty()) {
+		return glm::vec3(0.0f);
+	}
+	while (sums.size() > 1) {
+		for (size_t i = 0; i < sums.size() / 2; i++) {
+			sums[i] = sums[2 * i] + sums[2 * i + 1];
+		}
+		if (sums.size() % 2 == 1) {
+			sums[sums.size() / 2] = sums.back();
+		}
+		sums.resize((sums.size() + 1) / 2);
+	}
+	return sums[0];
+}
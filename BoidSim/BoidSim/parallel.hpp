@@ -0,0 +1,25 @@
+#ifndef parallel_hpp
+#define parallel_hpp
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include <glm/glm.hpp>
+
+// Steering runs on steerThreads threads. Every boid is steered by one thread from the same inputs in the same order,
+// so the result does not depend on the number of threads, as long as the cell size stays the same. The autotuner picks
+// it from the step time, which does depend on the threads. In deterministicMode a boid's neighbours are moreover added
+// up in order of boid index, so it does not depend on where they are in the grid either, and the cell size is pinned
+extern int steerThreads;
+extern bool deterministicMode;
+extern const int MAX_THREADS;
+
+// Calls work(begin, end) for the ranges [0, chunk), [chunk, 2 chunk), ... up to count, spread over steerThreads threads
+// (the calling one included). The helper threads are kept between calls. Returns when all ranges are done
+void parallelFor(uint32_t count, uint32_t chunk, const std::function<void(uint32_t, uint32_t)>& work);
+
+// Sum with a shape that only depends on the number of values: blocks of REDUCTION_BLOCK added in order, then the
+// block sums added pairwise. Gives the same bits however the values were computed
+glm::vec3 treeSum(const std::vector<glm::vec3>& values);
+
+#endif
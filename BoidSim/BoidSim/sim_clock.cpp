@@ -0,0 +1,29 @@
+#include "sim_clock.hpp"
+#include <algorithm>
+#include <cmath>
+
+int simRate = 120;
+const double TIME_UNIT = 1.0 / 60.0;
+const int MAX_STEPS_PER_FRAME = 8;
+
+float getStepLength() {
+	return (float)(1.0 / (simRate * TIME_UNIT));
+}
+
+int SimulationClock::advance(double frameSeconds) {
+	const double step = 1.0 / simRate;
+	accumulator += frameSeconds;
+	int steps = 0;
+	while (accumulator >= step && steps < MAX_STEPS_PER_FRAME) {
+		accumulator -= step;
+		steps++;
+	}
+	if (steps == MAX_STEPS_PER_FRAME && accumulator >= step) {
+		accumulator = std::fmod(accumulator, step);
+	}
+	return steps;
+}
+
+float SimulationClock::alpha() const {
+	return std::min((float)(accumulator * simRate), 1.0f);
+}
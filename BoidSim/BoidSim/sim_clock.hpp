@@ -0,0 +1,22 @@
+#ifndef sim_clock_hpp
+#define sim_clock_hpp
+
+// The simulation takes fixed steps, however fast or slow frames are rendered. A frame takes as many steps as the
+// time it covers and draws the boids between the last two of them
+extern int simRate; // steps per second, fewer and longer steps need a better integrator (see integrator.hpp)
+extern const double TIME_UNIT; // seconds, speeds and accelerations are per this much time (a frame at 60 Hz, what they were tuned at)
+extern const int MAX_STEPS_PER_FRAME;
+// One step in units of TIME_UNIT, what velocities and steering are multiplied by
+float getStepLength();
+
+struct SimulationClock {
+	double accumulator; // seconds not simulated yet, less than one step after advance
+	SimulationClock() : accumulator(0.0) {}
+	// Adds the time a frame covers and returns how many steps to take. After a stall of more than MAX_STEPS_PER_FRAME
+	// steps the rest is dropped, so the simulation slows down instead of falling further and further behind
+	int advance(double frameSeconds);
+	// Where the frame is between the second to last step (0) and the last one (1)
+	float alpha() const;
+};
+
+#endif
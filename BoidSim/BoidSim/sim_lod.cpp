@@ -0,0 +1,49 @@
+#include "sim_lod.hpp"
+#include "spatial_hash.hpp"
+#include <algorithm>
+#include <cmath>
+
+bool useSimLod = false;
+float lodDistance = 100.0f;
+const int MAX_LOD_LEVEL = 3;
+LodStats lodStats;
+std::vector<uint8_t> lodSteps;
+
+uint32_t lodStep = 0;
+std::vector<uint32_t> lastSteered; // lodStep when each boid was last steered
+
+void updateLod(const glm::vec3& eye, const glm::vec3& viewDir, float viewCos) {
+	lodStats = LodStats();
+	if (!useSimLod) {
+		lodSteps.clear();
+		lodStats.steered = (uint32_t)boids.size();
+		return;
+	}
+	lodStep++;
+	if (lastSteered.size() != boids.size()) {
+		lastSteered.assign(boids.size(), lodStep - 1);
+	}
+	lodSteps.resize(boids.size());
+	glm::vec3 forward = glm::normalize(viewDir);
+	for (uint32_t i = 0; i < boids.size(); i++) {
+		glm::vec3 offset = wrapOffset(boids[i].position - eye);
+		float distance = glm::length(offset);
+		int level = distance > lodDistance ? 1 + (int)std::log2(distance / lodDistance) : 0;
+		if (distance > 0.0f && glm::dot(offset, forward) < viewCos * distance) {
+			level++;
+		}
+		level = std::min(level, MAX_LOD_LEVEL);
+
+		// boids of the same level are spread over the steps of their period, so every step does about the same work
+		uint32_t period = 1u << level;
+		bool due = ((lodStep + i) & (period - 1)) == 0;
+		lodSteps[i] = due ? (uint8_t)std::min(lodStep - lastSteered[i], 255u) : 0;
+		if (due) {
+			lastSteered[i] = lodStep;
+			lodStats.steered++;
+		}
+		else {
+			lodStats.extrapolated++;
+		}
+	}
+}
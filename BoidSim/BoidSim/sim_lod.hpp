@@ -0,0 +1,33 @@
+#ifndef sim_lod_hpp
+#define sim_lod_hpp
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+
+// Level of detail for the simulation: boids far from the camera are only steered every few steps and fly straight on
+// in between. A boid at level k is steered every 2^k steps and then makes up for the steering it missed. Levels are
+// picked again every step, so a boid that comes closer is back at full rate straight away
+extern bool useSimLod;
+extern float lodDistance; // boids closer than this to the camera are steered every step, the level goes up each time the distance doubles
+extern const int MAX_LOD_LEVEL;
+
+struct LodStats {
+	uint32_t steered, extrapolated; // in the last step
+	LodStats() : steered(0), extrapolated(0) {}
+};
+extern LodStats lodStats;
+
+// How many steps of steering each boid gets this step (the steps since it was last steered), 0 if it flies straight on.
+// Empty if every boid gets one
+extern std::vector<uint8_t> lodSteps;
+
+// Picks the boids that are steered this step. Boids outside the cone of view (cosine of its half angle viewCos around
+// viewDir) are one level further down. Call once per step, before steerFlock
+void updateLod(const glm::vec3& eye, const glm::vec3& viewDir, float viewCos);
+
+inline bool isSteered(uint32_t i) {
+	return lodSteps.empty() || lodSteps[i] > 0;
+}
+
+#endif
@@ -1,115 +1,830 @@
 #include "spatial_hash.hpp"
+#include "parallel.hpp"
 #include <tuple>
 #include <vector>
+#include <cstdint>
 #include <unordered_map>
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+#include <cfloat>
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
 using std::tuple;
 
-#define USE_SPATIAL_HASH // comment out this for the naive n^2 version
-// Grid related stuff
-const float CELL_SIZE = 10.0f; // this should be the same value as the boids scope
-const int HASH_TABLE_SIZE = 997;
+// Grid related stuff, change with setGridParameters
+float boidScope = 10.0f; // how far a boid can see
+int cellDivisions = 2; // cells per boidScope (1 to MAX_CELL_DIVISIONS). Smaller cells gives fewer candidates to test
+float cellSize = boidScope / cellDivisions;
 
+// Autotuning of the cell size: every AUTOTUNE_INTERVAL steps each cell size is tried for AUTOTUNE_STEPS steps,
+// and the one with the shortest hash and steering time is kept until the next round. Density can change a lot during a run
+bool autotuneCells = true;
+const int AUTOTUNE_INTERVAL = 600;
+const int AUTOTUNE_STEPS = 10;
+CellSizeTrial cellSizeTrials[MAX_CELL_DIVISIONS + 1];
+
+// Far field: boids between boidScope and FAR_SCOPE are seen through aggregates of whole cells (Barnes-Hut style).
+// Level l of the aggregate pyramid has cells of size cellSize * 2^l, level 0 being the grid itself
+bool useFarField = false;
+const float FAR_SCOPE = 40.0f;
+const float FAR_OPENING_ANGLE = 0.5f; // a cell is used as a whole if size/distance is below this, otherwise it is opened
+const int FAR_LEVELS = 4;
+
+// Periodic world: positions wrap around at the faces of a cube of side WORLD_SIZE centred at the origin, and
+// neighbours are found across the seam (minimum image). setGridParameters makes the cells fit the world
+bool periodicWorld = false;
+const float WORLD_SIZE = 560.0f;
+
+// How many degrees around itself a boid can see, centred on the direction it is flying in. Below 360 there is a
+// blind spot behind the boid, which also lets getTileNeighbours skip cells and candidates early
+float fieldOfView = 360.0f;
+
+// Neighbour budget: no more than maxNeighbours (0 means no limit) are returned by getTileNeighbours, either the closest
+// ones or the first ones found. This bounds the cost of a boid in a dense clump
+int maxNeighbours = 0;
+bool closestNeighbours = true;
+NeighbourStats neighbourStats;
+thread_local NeighbourStats* threadNeighbourStats = &neighbourStats;
+
+// Offset (in cells) from the boids own cell to a cell that might contain neighbours
+struct StencilCell {
+	int i, j, k;
+	StencilCell(int i, int j, int k) : i(i), j(j), k(k) {}
+};
+
+// Only keeps the cells that some point in the center cell can reach within boidScope,
+// e.g. the corner cells are dropped when cellDivisions = 3. Closer cells come first
+std::vector<StencilCell> buildStencil(){
+	std::vector<StencilCell> cells;
+	const int r = cellDivisions;
+	for(int i = -r; i <= r; i++){
+		for(int j = -r; j <= r; j++){
+			for(int k = -r; k <= r; k++){
+				// closest distance between the center cell and cell (i,j,k) along each axis
+				float gx = std::max(0, std::abs(i) - 1) * cellSize;
+				float gy = std::max(0, std::abs(j) - 1) * cellSize;
+				float gz = std::max(0, std::abs(k) - 1) * cellSize;
+				if(gx*gx + gy*gy + gz*gz < boidScope*boidScope){
+					cells.push_back(StencilCell(i, j, k));
+				}
+			}
+		}
+	}
+	std::stable_sort(cells.begin(), cells.end(), [](const StencilCell& a, const StencilCell& b){
+		return a.i*a.i + a.j*a.j + a.k*a.k < b.i*b.i + b.j*b.j + b.k*b.k;
+	});
+	return cells;
+}
+std::vector<StencilCell> stencil = buildStencil();
+
+// Boids are referred to by their index in the boids vector, so the vector is free to reallocate or reorder between steps.
+// Every cell of a brick has a bucket, boids or not, so it only holds the cell's list of boids. The rest of what is known
+// about the cell is kept in occupiedCells
 struct BoidBucket{
-	Boid *head, *tail;
-	BoidBucket() : head(NULL), tail(NULL) {}
-    BoidBucket(Boid* b){
-	   head = tail = b;
-    }
-	BoidBucket(Boid* a, Boid* b){
-		head = a;
-		tail = b;
+	uint32_t head, tail;
+	uint32_t occupied; // index in occupiedCells, if head is not NO_BOID
+	BoidBucket() : head(NO_BOID), tail(NO_BOID), occupied(0) {}
+};
+
+// A non-empty cell: where its bucket is (brick index * BRICK_CELLS + cell within the brick), and its block in the packed
+// arrays below, filled in by packHashTable. Inside the block the boids are sorted by species, species s being from
+// speciesStart[s] to speciesStart[s+1]
+struct OccupiedCell{
+	uint32_t slot;
+	int x, y, z;
+	uint32_t speciesStart[NR_SPECIES + 1];
+};
+
+// Sums over all boids of each species in a cell of the coarser far field levels
+struct CellAggregate{
+	uint32_t count[NR_SPECIES];
+	glm::vec3 positionSum[NR_SPECIES], velocitySum[NR_SPECIES];
+	CellAggregate(){
+		for(int s = 0; s < NR_SPECIES; s++){
+			count[s] = 0;
+			positionSum[s] = velocitySum[s] = glm::vec3(0.0f);
+		}
 	}
 };
 
-// HashTable with all the boids
-//ska::flat_hash_map<unsigned long, BoidBucket> cellBuckets = ska::flat_hash_map<unsigned long, BoidBucket>();
-std::unordered_map<unsigned long, BoidBucket> cellBuckets = std::unordered_map<unsigned long, BoidBucket>();
-// Table containing one (if any) cell neighbour for each boid 
-std::vector<Boid*> nextBoid(nrBoids, NULL);
+// The grid is stored sparsely in bricks of BRICK_SIZE^3 cells. A brick is allocated when a boid enters it and goes back
+// to a pool when it has been empty for a whole step, so memory follows the occupied space rather than the world size
+const int BRICK_BITS = 3;
+const int BRICK_SIZE = 1 << BRICK_BITS;
+const int BRICK_CELLS = BRICK_SIZE*BRICK_SIZE*BRICK_SIZE;
 
-// Helper function to convert a boids absolute address to it's offset in the vector containing all boids
-inline int absToOffset(Boid* b){
-    return ((long)b - (long)&boids[0])/sizeof(Boid); 
-} 
+struct Brick{
+	BoidBucket cells[BRICK_CELLS];
+	uint32_t nrBoids; // boids put in this brick since the last clear
+	Brick() : nrBoids(0) {}
+};
 
-// This part is for hashing tuples of ints. Standard hash maps can only hash enum types
-template <class T>
-inline void hash_combine(std::size_t &seed, T &v)
-{
-    std::hash<T> hasher;
-    seed ^= hasher(v) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
-}
+// Page table from brick coordinates (packed by packCell) to the brick's index in bricks
+std::unordered_map<uint64_t, uint32_t> brickTable;
+std::vector<Brick> bricks;
+std::vector<uint32_t> freeBricks;
+// Every non-empty cell, in the order their first boid was put in
+std::vector<OccupiedCell> occupiedCells;
+// Table containing the index of the next boid in the same cell (if any) for each boid 
+std::vector<uint32_t> nextBoid;
+
+// Positions of all boids stored cell by cell (SoA) so that a cell's content can be scanned as one contiguous block.
+// The arrays have SIMD_WIDTH slots of slack at the end so the last block can always be loaded whole
+const int SIMD_WIDTH = 8;
+std::vector<float> cellX, cellY, cellZ;
+std::vector<float> cellVX, cellVY, cellVZ;
+std::vector<uint32_t> cellIndex;
+
+// Far field level 0, indexed like occupiedCells, and levels 1 to FAR_LEVELS-1, keyed by packCell
+std::vector<CellAggregate> cellAggregates;
+std::unordered_map<uint64_t, CellAggregate> aggregateLevels[FAR_LEVELS];
+
+// Where the boids of each species are, on a grid with cells of cellSize * 2^SPECIES_LEVEL, so that getSpeciesInBox only
+// looks where there are boids of the species asked for. A run is a grid cell's boids of the species (a range of the
+// packed arrays), and the runs in the same coarse cell are linked through next. Only built when there are boids of
+// more than one species, as nothing looks for a species but the others
+const int SPECIES_LEVEL = 3;
+struct SpeciesRun{
+	int x, y, z; // grid cell
+	uint32_t begin, end, next;
+};
+struct SpeciesCell{
+	int x, y, z; // coarse cell
+	uint32_t head; // first run
+};
+struct SpeciesIndex{
+	std::vector<SpeciesRun> runs;
+	std::vector<SpeciesCell> cells;
+	std::unordered_map<uint64_t, uint32_t> cellTable; // packCell of a coarse cell to its place in cells
+};
+SpeciesIndex speciesIndex[NR_SPECIES];
 
 void clearHashTable(){
-    cellBuckets.clear();
+	for(const OccupiedCell& c : occupiedCells){
+		bricks[c.slot / BRICK_CELLS].cells[c.slot % BRICK_CELLS] = BoidBucket();
+	}
+	occupiedCells.clear();
+	// bricks that no boid entered since the last clear go back to the pool
+	for(auto iter = brickTable.begin(); iter != brickTable.end();){
+		Brick& brick = bricks[iter->second];
+		if(brick.nrBoids == 0){
+			freeBricks.push_back(iter->second);
+			iter = brickTable.erase(iter);
+		} else {
+			brick.nrBoids = 0;
+			++iter;
+		}
+	}
+	for(int l = 1; l < FAR_LEVELS; l++){
+		aggregateLevels[l].clear();
+	}
+	for(SpeciesIndex& index : speciesIndex){
+		index.runs.clear();
+		index.cells.clear();
+		index.cellTable.clear();
+	}
+}
+
+// Exact key for a cell, 21 bits per axis
+inline uint64_t packCell(int x, int y, int z){
+	const uint64_t mask = (1 << 21) - 1;
+	return ((uint64_t)x & mask) | (((uint64_t)y & mask) << 21) | (((uint64_t)z & mask) << 42);
+}
+
+// Which brick cell (x,y,z) is in, and where in that brick
+inline uint64_t getBrickKey(int x, int y, int z){
+	return packCell(x >> BRICK_BITS, y >> BRICK_BITS, z >> BRICK_BITS);
+}
+
+inline int getCellInBrick(int x, int y, int z){
+	const int mask = BRICK_SIZE - 1;
+	return ((z & mask)*BRICK_SIZE + (y & mask))*BRICK_SIZE + (x & mask);
+}
+
+// Cell (x,y,z), or NULL if there are no boids in it
+inline const OccupiedCell* findCell(int x, int y, int z){
+	auto iter = brickTable.find(getBrickKey(x, y, z));
+	if(iter == brickTable.end()){
+		return NULL;
+	}
+	const BoidBucket& bucket = bricks[iter->second].cells[getCellInBrick(x, y, z)];
+	return bucket.head == NO_BOID ? NULL : &occupiedCells[bucket.occupied];
+}
+
+// Index of the brick with cell (x,y,z), taken from the pool if that part of the world has no brick yet
+uint32_t getBrick(int x, int y, int z){
+	uint64_t key = getBrickKey(x, y, z);
+	auto iter = brickTable.find(key);
+	if(iter != brickTable.end()){
+		return iter->second;
+	}
+	uint32_t index;
+	if(!freeBricks.empty()){
+		index = freeBricks.back();
+		freeBricks.pop_back();
+	} else {
+		index = bricks.size();
+		bricks.push_back(Brick());
+	}
+	brickTable.insert(std::pair<uint64_t, uint32_t>(key, index));
+	return index;
+}
+
+// Number of cells along each axis of a periodic world on the given far field level
+inline int getWorldCells(int level){
+	return (int)(WORLD_SIZE / (cellSize * (1 << level)) + 0.5f);
 }
 
-// Hashes tuples of ints
-long getCellHash(tuple<int, int, int> cell){
-	size_t seed = 0;
-    hash_combine(seed, std::get<0>(cell));
-    hash_combine(seed, std::get<1>(cell));
-	hash_combine(seed, std::get<2>(cell));
-    return seed;
+// Cell coordinate c moved into [-n/2, n/2), the cells of a periodic world centred at the origin
+inline int wrapCell(int c, int n){
+	c = (c + n/2) % n;
+	return (c < 0 ? c + n : c) - n/2;
 }
 
 inline tuple<int, int, int> getCell(glm::vec3 pos){
-	glm::vec3 cell = glm::floor(pos * (1.0f/CELL_SIZE));
+	glm::vec3 cell = glm::floor(pos * (1.0f/cellSize));
 	return tuple<int,int,int>(cell.x, cell.y, cell.z);  
 }
 
-// Puts boid b in the correct place in the hash table
-void putInHashTable(Boid& b){
-	tuple<int, int, int> cell = getCell(b.position); // which cell is the boid currently in
-	size_t cellHash = getCellHash(cell);
-	auto iter = cellBuckets.find(cellHash);
-	if(iter != cellBuckets.end()){
-		Boid* head = iter->second.head;
-		Boid* oldTail = iter->second.tail;
-   		iter->second = BoidBucket(head, &b);
-    	int i = absToOffset(oldTail);// check offset from boids vector base (="index" of boid in vector)
-    	nextBoid[i] = &b; // the old tail boid now points to the new tail
+// Puts boid number i in the correct place in the hash table
+void putInHashTable(uint32_t i){
+	if(nextBoid.size() != boids.size()){
+		nextBoid.resize(boids.size(), NO_BOID);
+	}
+	tuple<int, int, int> cell = getCell(boids[i].position); // which cell is the boid currently in
+	if(periodicWorld){
+		int n = getWorldCells(0);
+		cell = tuple<int, int, int>(wrapCell(std::get<0>(cell), n), wrapCell(std::get<1>(cell), n), wrapCell(std::get<2>(cell), n));
+	}
+	int x = std::get<0>(cell), y = std::get<1>(cell), z = std::get<2>(cell);
+	uint32_t brickIndex = getBrick(x, y, z);
+	Brick& brick = bricks[brickIndex];
+	brick.nrBoids++;
+	int c = getCellInBrick(x, y, z);
+	BoidBucket& bucket = brick.cells[c];
+	if(bucket.head != NO_BOID){
+		uint32_t oldTail = bucket.tail;
+   		bucket.tail = i;
+    	nextBoid[oldTail] = i; // the old tail boid now points to the new tail
 	} else {
-		cellBuckets.insert(std::pair<size_t, BoidBucket>(cellHash, BoidBucket(&b)));
-	}
-	
-}
-
-// A little helper function that checks if b is within a's scope
-inline bool validNeighbour(Boid& a, Boid& b){
-	if(a.position != b.position && distance(a.position, b.position) < 10.0f){
-		return true;
-	}
-	return false;
-}
-
-std::vector<Boid*> getNeighbours(Boid& b){
-	// check all 3*3 neighbouring cells for boids
-	tuple<int, int,int> cell = getCell(b.position); 
-	// Collect all neighbours in a vector. Future optimization: iterate over neighbours directly instead of collecting in vector
-	std::vector<Boid*> neighbours; 
-	int boidIndex = absToOffset(&b);
-	for(int i= -1; i <= 1; i++){
-		for(int j= -1; j <= 1; j++){
-			for(int k= -1; k <= 1; k++){
-				tuple<int, int,int> neighbourCell = {std::get<0>(cell)+i, std::get<1>(cell)+j, std::get<2>(cell)+k}; 
-				auto iter = cellBuckets.find(getCellHash(neighbourCell));
-				if(iter != cellBuckets.end()){
-					Boid* current = iter->second.head;
-					Boid* tail = iter->second.tail;
-					if(validNeighbour(b, *current)){
-						neighbours.push_back(current);
+		bucket.head = bucket.tail = i;
+		bucket.occupied = occupiedCells.size();
+		OccupiedCell occupied = {brickIndex*BRICK_CELLS + c, x, y, z, {}};
+		occupiedCells.push_back(occupied);
+	}
+	nextBoid[i] = NO_BOID;
+}
+
+// Sums up position and velocity of every cell, and of every cell in the coarser levels. Needs the counts from packHashTable
+void buildAggregates(){
+	cellAggregates.assign(occupiedCells.size(), CellAggregate());
+	for(uint32_t c = 0; c < occupiedCells.size(); c++){
+		const OccupiedCell& cell = occupiedCells[c];
+		const BoidBucket& bucket = bricks[cell.slot / BRICK_CELLS].cells[cell.slot % BRICK_CELLS];
+		CellAggregate& aggregate = cellAggregates[c];
+		for(int s = 0; s < NR_SPECIES; s++){
+			aggregate.count[s] = cell.speciesStart[s + 1] - cell.speciesStart[s];
+		}
+		for(uint32_t i = bucket.head; i != NO_BOID; i = nextBoid[i]){
+			aggregate.positionSum[boids[i].species] += boids[i].position;
+			aggregate.velocitySum[boids[i].species] += boids[i].velocity;
+		}
+		for(int l = 1; l < FAR_LEVELS; l++){
+			// >> rounds towards minus infinity, so this is the parent cell also for negative coordinates
+			CellAggregate& parent = aggregateLevels[l][packCell(cell.x >> l, cell.y >> l, cell.z >> l)];
+			for(int s = 0; s < NR_SPECIES; s++){
+				parent.count[s] += aggregate.count[s];
+				parent.positionSum[s] += aggregate.positionSum[s];
+				parent.velocitySum[s] += aggregate.velocitySum[s];
+			}
+		}
+	}
+}
+
+// Adds the boids of a species in a grid cell, from begin to end in the packed arrays, to the species' index
+void addSpeciesRun(SpeciesIndex& index, const OccupiedCell& cell, uint32_t begin, uint32_t end){
+	int x = cell.x, y = cell.y, z = cell.z;
+	auto inserted = index.cellTable.insert(std::pair<uint64_t, uint32_t>(packCell(x >> SPECIES_LEVEL, y >> SPECIES_LEVEL, z >> SPECIES_LEVEL), index.cells.size()));
+	if(inserted.second){
+		index.cells.push_back(SpeciesCell{x >> SPECIES_LEVEL, y >> SPECIES_LEVEL, z >> SPECIES_LEVEL, NO_BOID});
+	}
+	SpeciesCell& coarse = index.cells[inserted.first->second];
+	index.runs.push_back(SpeciesRun{x, y, z, begin, end, coarse.head});
+	coarse.head = index.runs.size() - 1;
+}
+
+// Copies the boids of every cell into the packed arrays. Call this after all boids have been put in the hash table
+void packHashTable(){
+	neighbourStats = NeighbourStats();
+	size_t size = boids.size() + SIMD_WIDTH;
+	cellX.resize(size);
+	cellY.resize(size);
+	cellZ.resize(size);
+	cellVX.resize(size);
+	cellVY.resize(size);
+	cellVZ.resize(size);
+	cellIndex.resize(size, NO_BOID);
+	uint32_t next = 0;
+	bool present[NR_SPECIES] = {};
+	for(OccupiedCell& cell : occupiedCells){
+		const BoidBucket& bucket = bricks[cell.slot / BRICK_CELLS].cells[cell.slot % BRICK_CELLS];
+		for(int s = 0; s < NR_SPECIES; s++){
+			cell.speciesStart[s] = next;
+			for(uint32_t i = bucket.head; i != NO_BOID; i = nextBoid[i]){
+				if(boids[i].species != s){
+					continue;
+				}
+				cellX[next] = boids[i].position.x;
+				cellY[next] = boids[i].position.y;
+				cellZ[next] = boids[i].position.z;
+				cellVX[next] = boids[i].velocity.x;
+				cellVY[next] = boids[i].velocity.y;
+				cellVZ[next] = boids[i].velocity.z;
+				cellIndex[next] = i;
+				next++;
+			}
+			present[s] = present[s] || cell.speciesStart[s] < next;
+		}
+		cell.speciesStart[NR_SPECIES] = next;
+	}
+	if(std::count(present, present + NR_SPECIES, true) > 1){
+		for(const OccupiedCell& cell : occupiedCells){
+			for(int s = 0; s < NR_SPECIES; s++){
+				if(cell.speciesStart[s] < cell.speciesStart[s + 1]){
+					addSpeciesRun(speciesIndex[s], cell, cell.speciesStart[s], cell.speciesStart[s + 1]);
+				}
+			}
+		}
+	}
+	if(useFarField){
+		buildAggregates();
+	}
+}
+
+// The directions a boid can see in: within angle of dir. When it is not active the boid sees all around
+struct ViewCone{
+	bool active;
+	glm::vec3 dir;
+	float cosAngle, sinAngle;
+};
+
+ViewCone getViewCone(const glm::vec3& velocity){
+	ViewCone view;
+	float speed = glm::length(velocity);
+	view.active = fieldOfView < 360.0f && speed > 0.0f;
+	view.dir = view.active ? velocity * (1.0f / speed) : glm::vec3(0.0f);
+	float angle = glm::radians(std::max(fieldOfView, 0.0f) * 0.5f);
+	view.cosAngle = std::cos(angle);
+	view.sinAngle = std::sin(angle);
+	return view;
+}
+
+// True if all of the sphere at offset centre (from the boid) with the given radius is outside the view cone.
+// That is the case when the angle to the centre is larger than the cone's angle plus the angle the sphere covers
+inline bool outsideView(const ViewCone& view, const glm::vec3& centre, float radius){
+	float dist2 = glm::dot(centre, centre);
+	if(!view.active || dist2 <= radius*radius){
+		return false;
+	}
+	float dist = std::sqrt(dist2);
+	float sinCover = radius / dist;
+	if(view.cosAngle <= 0.0f && sinCover >= view.sinAngle){
+		return false; // the widened cone covers all directions
+	}
+	float cosCover = std::sqrt(1.0f - sinCover*sinCover);
+	float cosWidened = view.cosAngle*cosCover - view.sinAngle*sinCover;
+	return glm::dot(view.dir, centre) < cosWidened*dist;
+}
+
+// Tests count packed boids (positions in x, y, z) against position p, SIMD_WIDTH boids at a time, and appends the ids
+// of the ones within boidScope and the view cone (except boids at exactly p, e.g. the boid itself) at out, which must
+// have room for count of them. Returns the end of what was written.
+// The arrays must have SIMD_WIDTH slots of slack after count. Survivors are written without branching:
+// every lane is stored and the output position only advances for lanes that passed
+inline uint32_t* scanBlock(const glm::vec3& p, const float* cellX, const float* cellY, const float* cellZ, const uint32_t* ids, uint32_t count,
+	const ViewCone& view, uint32_t* out){
+	size_t n = 0;
+	threadNeighbourStats->candidates += count;
+	const float scope2 = boidScope*boidScope;
+	const float cos2 = view.cosAngle*view.cosAngle;
+	for(uint32_t first = 0; first < count; first += SIMD_WIDTH){
+		int inside[SIMD_WIDTH];
+#if defined(__AVX__)
+		__m256 dx = _mm256_sub_ps(_mm256_loadu_ps(&cellX[first]), _mm256_set1_ps(p.x));
+		__m256 dy = _mm256_sub_ps(_mm256_loadu_ps(&cellY[first]), _mm256_set1_ps(p.y));
+		__m256 dz = _mm256_sub_ps(_mm256_loadu_ps(&cellZ[first]), _mm256_set1_ps(p.z));
+		__m256 d2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+		__m256 hit = _mm256_and_ps(_mm256_cmp_ps(d2, _mm256_set1_ps(scope2), _CMP_LT_OQ), _mm256_cmp_ps(d2, _mm256_setzero_ps(), _CMP_GT_OQ));
+		if(view.active){
+			// compares squares, so that no square root is needed to get the angle
+			__m256 along = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, _mm256_set1_ps(view.dir.x)), _mm256_mul_ps(dy, _mm256_set1_ps(view.dir.y))), _mm256_mul_ps(dz, _mm256_set1_ps(view.dir.z)));
+			__m256 ahead = _mm256_cmp_ps(along, _mm256_setzero_ps(), _CMP_GE_OQ);
+			__m256 along2 = _mm256_mul_ps(along, along);
+			__m256 cos2d2 = _mm256_mul_ps(_mm256_set1_ps(cos2), d2);
+			__m256 seen = view.cosAngle >= 0.0f ? _mm256_and_ps(ahead, _mm256_cmp_ps(along2, cos2d2, _CMP_GE_OQ)) : _mm256_or_ps(ahead, _mm256_cmp_ps(along2, cos2d2, _CMP_LE_OQ));
+			hit = _mm256_and_ps(hit, seen);
+		}
+		int mask = _mm256_movemask_ps(hit);
+		for(int l = 0; l < SIMD_WIDTH; l++){
+			inside[l] = (mask >> l) & 1;
+		}
+#else
+		// fixed width loop, written so that the compiler can vectorize it
+		for(int l = 0; l < SIMD_WIDTH; l++){
+			float dx = cellX[first + l] - p.x;
+			float dy = cellY[first + l] - p.y;
+			float dz = cellZ[first + l] - p.z;
+			float d2 = dx*dx + dy*dy + dz*dz;
+			inside[l] = (d2 < scope2) & (d2 > 0.0f);
+		}
+		if(view.active){
+			// compares squares, so that no square root is needed to get the angle
+			for(int l = 0; l < SIMD_WIDTH; l++){
+				float dx = cellX[first + l] - p.x;
+				float dy = cellY[first + l] - p.y;
+				float dz = cellZ[first + l] - p.z;
+				float d2 = dx*dx + dy*dy + dz*dz;
+				float along = dx*view.dir.x + dy*view.dir.y + dz*view.dir.z;
+				int ahead = along >= 0.0f;
+				int seen = view.cosAngle >= 0.0f ? ahead & (along*along >= cos2*d2) : ahead | (along*along <= cos2*d2);
+				inside[l] &= seen;
+			}
+		}
+#endif
+		const uint32_t lanes = std::min<uint32_t>(SIMD_WIDTH, count - first);
+		for(uint32_t l = 0; l < lanes; l++){
+			out[n] = ids[first + l];
+			n += inside[l];
+		}
+	}
+	return out + n;
+}
+
+// Cuts neighbours down to maxNeighbours, keeping the closest ones if closestNeighbours is set.
+// distance2 gives the squared distance to a neighbour
+template <class Distance>
+void applyBudget(std::vector<uint32_t>& neighbours, Distance distance2){
+	threadNeighbourStats->queries++;
+	threadNeighbourStats->found += neighbours.size();
+	if(maxNeighbours > 0 && neighbours.size() > (size_t)maxNeighbours){
+		threadNeighbourStats->truncated++;
+		if(closestNeighbours){
+			std::nth_element(neighbours.begin(), neighbours.begin() + maxNeighbours, neighbours.end(), [&distance2](uint32_t n, uint32_t m){
+				return distance2(n) < distance2(m);
+			});
+		}
+		neighbours.resize(maxNeighbours);
+	}
+}
+
+// Squared distance along one axis from a boid (at local coordinate f inside its cell) to the cell "offset" steps away
+inline float axisGap(float f, int offset){
+	float gap = 0.0f;
+	if(offset > 0){
+		gap = offset*cellSize - f;
+	} else if(offset < 0){
+		gap = f - (offset + 1)*cellSize;
+	}
+	return gap*gap;
+}
+
+uint32_t getNrCells(){
+	return occupiedCells.size();
+}
+
+void loadTile(uint32_t cell, int species, NeighbourTile& tile){
+	const OccupiedCell& centre = occupiedCells[cell];
+	tile.x.clear(); tile.y.clear(); tile.z.clear();
+	tile.vx.clear(); tile.vy.clear(); tile.vz.clear();
+	tile.index.clear();
+	tile.cells.clear();
+	tile.origin = glm::vec3(centre.x, centre.y, centre.z)*cellSize;
+	tile.centreCount = centre.speciesStart[species + 1] - centre.speciesStart[species];
+	if(tile.centreCount == 0){
+		tile.size = 0;
+		return;
+	}
+	// the stencil starts with the centre cell itself, so its boids end up first
+	for(const StencilCell& s : stencil){
+		int x = centre.x + s.i, y = centre.y + s.j, z = centre.z + s.k;
+		glm::vec3 shift(0.0f);
+		if(periodicWorld){
+			int n = getWorldCells(0);
+			int wx = wrapCell(x, n), wy = wrapCell(y, n), wz = wrapCell(z, n);
+			shift = glm::vec3(x - wx, y - wy, z - wz)*cellSize;
+			x = wx; y = wy; z = wz;
+		}
+		const OccupiedCell* occupied = findCell(x, y, z);
+		if(occupied == NULL || occupied->speciesStart[species] == occupied->speciesStart[species + 1]){
+			continue;
+		}
+		NeighbourTile::Cell tileCell = {s.i, s.j, s.k, (uint32_t)tile.index.size(), 0, true};
+		for(uint32_t i = occupied->speciesStart[species]; i < occupied->speciesStart[species + 1]; i++){
+			tile.x.push_back(cellX[i] + shift.x);
+			tile.y.push_back(cellY[i] + shift.y);
+			tile.z.push_back(cellZ[i] + shift.z);
+			tile.vx.push_back(cellVX[i]);
+			tile.vy.push_back(cellVY[i]);
+			tile.vz.push_back(cellVZ[i]);
+			tile.index.push_back(cellIndex[i]);
+		}
+		tileCell.end = tile.index.size();
+		// testing whether a boid can skip a cell costs about as much as scanning a few boids, so cells with less than
+		// SIMD_WIDTH of them are joined into runs that are always scanned
+		tileCell.single = tileCell.end - tileCell.begin >= SIMD_WIDTH;
+		if(!tileCell.single && !tile.cells.empty() && !tile.cells.back().single){
+			tile.cells.back().end = tileCell.end;
+		} else {
+			tile.cells.push_back(tileCell);
+		}
+	}
+	tile.size = tile.index.size();
+	// slack for scanBlock, far away so that it never passes
+	for(int l = 0; l < SIMD_WIDTH; l++){
+		tile.x.push_back(FLT_MAX); tile.y.push_back(FLT_MAX); tile.z.push_back(FLT_MAX);
+		tile.index.push_back(NO_BOID);
+	}
+	while(tile.slot.size() < tile.index.size()){
+		tile.slot.push_back(tile.slot.size());
+	}
+}
+
+void getTileNeighbours(const NeighbourTile& tile, uint32_t slot, std::vector<uint32_t>& neighbours){
+	glm::vec3 p(tile.x[slot], tile.y[slot], tile.z[slot]);
+	ViewCone view = getViewCone(glm::vec3(tile.vx[slot], tile.vy[slot], tile.vz[slot]));
+	// where in the centre cell the boid is, used to skip tile cells that are out of reach for this particular boid
+	glm::vec3 local = p - tile.origin;
+	const int r = cellDivisions;
+	float gapX[2*MAX_CELL_DIVISIONS + 1], gapY[2*MAX_CELL_DIVISIONS + 1], gapZ[2*MAX_CELL_DIVISIONS + 1];
+	for(int o = -r; o <= r; o++){
+		gapX[o + r] = axisGap(local.x, o);
+		gapY[o + r] = axisGap(local.y, o);
+		gapZ[o + r] = axisGap(local.z, o);
+	}
+	const float cellRadius = cellSize * 0.8660254f; // half the diagonal of a cell
+	// what is in neighbours gets overwritten, it only needs to be long enough
+	if(neighbours.size() < tile.size){
+		neighbours.resize(tile.size);
+	}
+	uint32_t* out = neighbours.data();
+	// cells that are not skipped and follow each other in the tile are scanned as one run, so that the SIMD lanes
+	// stay full. The slack after the tile covers the reads past the end of a run
+	uint32_t runBegin = 0, runEnd = 0;
+	for(size_t n = 0; n <= tile.cells.size(); n++){
+		const bool last = n == tile.cells.size();
+		if(!last){
+			const NeighbourTile::Cell& c = tile.cells[n];
+			if(c.single){
+				if(gapX[c.i + r] + gapY[c.j + r] + gapZ[c.k + r] >= boidScope*boidScope){
+					continue;
+				}
+				if(view.active && outsideView(view, (glm::vec3(c.i, c.j, c.k) + 0.5f)*cellSize - local, cellRadius)){
+					continue; // e.g. behind the boid
+				}
+			}
+			if(c.begin == runEnd){
+				runEnd = c.end;
+				continue;
+			}
+		}
+		out = scanBlock(p, &tile.x[runBegin], &tile.y[runBegin], &tile.z[runBegin], &tile.slot[runBegin], runEnd - runBegin, view, out);
+		if(last || (maxNeighbours > 0 && !closestNeighbours && out - neighbours.data() > maxNeighbours)){
+			break; // after the budget is used up, the rest would be cut away anyway
+		}
+		runBegin = tile.cells[n].begin;
+		runEnd = tile.cells[n].end;
+	}
+	neighbours.resize(out - neighbours.data());
+	applyBudget(neighbours, [&tile, &p](uint32_t n){
+		glm::vec3 d = glm::vec3(tile.x[n], tile.y[n], tile.z[n]) - p;
+		return glm::dot(d, d);
+	});
+}
+
+// Appends the runs of a coarse cell that overlap the grid cells from first to last. shift (in grid cells) moves the runs
+// next to the box when the coarse cell was wrapped across the seam of a periodic world
+void addSpeciesCell(const SpeciesIndex& index, const SpeciesCell& coarse, const glm::ivec3& first, const glm::ivec3& last, const glm::ivec3& shift,
+	std::vector<uint32_t>& candidates){
+	for(uint32_t r = coarse.head; r != NO_BOID; r = index.runs[r].next){
+		const SpeciesRun& run = index.runs[r];
+		glm::ivec3 cell = glm::ivec3(run.x, run.y, run.z) + shift;
+		if(cell.x >= first.x && cell.y >= first.y && cell.z >= first.z && cell.x <= last.x && cell.y <= last.y && cell.z <= last.z){
+			candidates.insert(candidates.end(), &cellIndex[run.begin], &cellIndex[run.end]);
+		}
+	}
+}
+
+void getSpeciesInBox(const glm::vec3& lo, const glm::vec3& hi, int species, std::vector<uint32_t>& candidates){
+	candidates.clear();
+	const SpeciesIndex& index = speciesIndex[species];
+	const glm::ivec3 first(glm::floor(lo * (1.0f/cellSize))), last(glm::floor(hi * (1.0f/cellSize)));
+	const glm::ivec3 coarseFirst(first.x >> SPECIES_LEVEL, first.y >> SPECIES_LEVEL, first.z >> SPECIES_LEVEL);
+	const glm::ivec3 coarseLast(last.x >> SPECIES_LEVEL, last.y >> SPECIES_LEVEL, last.z >> SPECIES_LEVEL);
+	const glm::ivec3 span = coarseLast - coarseFirst + 1;
+	const int n = getWorldCells(SPECIES_LEVEL);
+	// either every coarse cell of the box is looked up, or every coarse cell of the species is tested, whatever is less
+	if((size_t)span.x*span.y*span.z <= index.cells.size()){
+		for(int k = coarseFirst.z; k <= coarseLast.z; k++){
+			for(int j = coarseFirst.y; j <= coarseLast.y; j++){
+				for(int i = coarseFirst.x; i <= coarseLast.x; i++){
+					glm::ivec3 coarse(i, j, k);
+					if(periodicWorld){
+						coarse = glm::ivec3(wrapCell(i, n), wrapCell(j, n), wrapCell(k, n));
 					}
-					while(current != tail){
-						int l = absToOffset(current);
-						current = nextBoid[l];
-						if(validNeighbour(b, *current)){
-							neighbours.push_back(current); 
-						}
+					auto iter = index.cellTable.find(packCell(coarse.x, coarse.y, coarse.z));
+					if(iter != index.cellTable.end()){
+						addSpeciesCell(index, index.cells[iter->second], first, last, (glm::ivec3(i, j, k) - coarse) * (1 << SPECIES_LEVEL), candidates);
 					}
-				} 
+				}
 			}
 		}
+		return;
+	}
+	for(const SpeciesCell& coarse : index.cells){
+		glm::ivec3 c(coarse.x, coarse.y, coarse.z);
+		if(periodicWorld){
+			// the first copy of the cell from the low corner of the box on
+			for(int a = 0; a < 3; a++){
+				c[a] = coarseFirst[a] + ((c[a] - coarseFirst[a]) % n + n) % n;
+			}
+		}
+		if(c.x <= coarseLast.x && c.y <= coarseLast.y && c.z <= coarseLast.z && c.x >= coarseFirst.x && c.y >= coarseFirst.y && c.z >= coarseFirst.z){
+			addSpeciesCell(index, coarse, first, last, (c - glm::ivec3(coarse.x, coarse.y, coarse.z)) * (1 << SPECIES_LEVEL), candidates);
+		}
+	}
+}
+
+// Squared distance from p to the closest and to the furthest point of the cube with corner lo and side size
+inline void boxDistances(const glm::vec3& p, const glm::vec3& lo, float size, float& nearest2, float& furthest2){
+	nearest2 = furthest2 = 0.0f;
+	for(int a = 0; a < 3; a++){
+		float below = lo[a] - p[a];
+		float above = p[a] - (lo[a] + size);
+		float nearest = std::max(0.0f, std::max(below, above));
+		float furthest = std::max(p[a] - lo[a], lo[a] + size - p[a]);
+		nearest2 += nearest*nearest;
+		furthest2 += furthest*furthest;
+	}
+}
+
+// Adds the boids in cell (x,y,z) of the given level that are between boidScope and FAR_SCOPE from p.
+// The cell is used as a whole if it is small enough seen from p, otherwise its children are visited.
+// shift is added to all positions found, it is non-zero when the cell was wrapped across the seam of a periodic world
+void addFarCell(glm::vec3 p, int species, int level, int x, int y, int z, glm::vec3 shift, FarField& far){
+	const float scope2 = boidScope*boidScope;
+	const float farScope2 = FAR_SCOPE*FAR_SCOPE;
+	float size = cellSize * (1 << level);
+	float nearest2, furthest2;
+	boxDistances(p, glm::vec3(x, y, z)*size, size, nearest2, furthest2);
+	if(nearest2 >= farScope2 || furthest2 < scope2){
+		return; // nothing in this cell is in the far field
+	}
+
+	if(periodicWorld){
+		int n = getWorldCells(level);
+		int wx = wrapCell(x, n), wy = wrapCell(y, n), wz = wrapCell(z, n);
+		glm::vec3 wrap = glm::vec3(x - wx, y - wy, z - wz)*size;
+		p -= wrap;
+		shift += wrap;
+		x = wx; y = wy; z = wz;
+	}
+
+	const CellAggregate* aggregate;
+	const OccupiedCell* cell = NULL;
+	if(level == 0){
+		cell = findCell(x, y, z);
+		if(cell == NULL){
+			return;
+		}
+		aggregate = &cellAggregates[cell - occupiedCells.data()];
+	} else {
+		auto iter = aggregateLevels[level].find(packCell(x, y, z));
+		if(iter == aggregateLevels[level].end()){
+			return;
+		}
+		aggregate = &iter->second;
+	}
+	const float count = (float)aggregate->count[species];
+	if(count == 0.0f){
+		return;
+	}
+
+	glm::vec3 centre = aggregate->positionSum[species] * (1.0f / count);
+	float d2 = glm::dot(centre - p, centre - p);
+	if(nearest2 >= scope2 && size*size < FAR_OPENING_ANGLE*FAR_OPENING_ANGLE*d2){
+		if(d2 < farScope2){
+			far.count += count;
+			far.positionSum += aggregate->positionSum[species] + shift*count;
+			far.velocitySum += aggregate->velocitySum[species];
+		}
+		return;
+	}
+
+	if(level > 0){
+		for(int c = 0; c < 8; c++){
+			addFarCell(p, species, level - 1, 2*x + (c & 1), 2*y + ((c >> 1) & 1), 2*z + ((c >> 2) & 1), shift, far);
+		}
+		return;
+	}
+
+	// a grid cell that is too close to be approximated, look at its boids one by one
+	for(uint32_t s = cell->speciesStart[species]; s < cell->speciesStart[species + 1]; s++){
+		glm::vec3 d = glm::vec3(cellX[s], cellY[s], cellZ[s]) - p;
+		float dist2 = glm::dot(d, d);
+		if(dist2 >= scope2 && dist2 < farScope2){
+			far.count += 1.0f;
+			far.positionSum += boids[cellIndex[s]].position + shift;
+			far.velocitySum += boids[cellIndex[s]].velocity;
+		}
+	}
+}
+
+FarField getFarField(uint32_t index){
+	FarField far;
+	const glm::vec3& p = boids[index].position;
+	const int top = FAR_LEVELS - 1;
+	const float size = cellSize * (1 << top);
+	const int r = (int)std::ceil(FAR_SCOPE / size);
+	glm::vec3 cell = glm::floor(p * (1.0f/size));
+	for(int i = -r; i <= r; i++){
+		for(int j = -r; j <= r; j++){
+			for(int k = -r; k <= r; k++){
+				addFarCell(p, boids[index].species, top, (int)cell.x + i, (int)cell.y + j, (int)cell.z + k, glm::vec3(0.0f), far);
+			}
+		}
+	}
+	return far;
+}
+
+void setGridParameters(float scope, int divisions){
+	boidScope = scope;
+	cellDivisions = std::max(1, std::min(divisions, MAX_CELL_DIVISIONS));
+	cellSize = boidScope / cellDivisions;
+	if(periodicWorld){
+		// the world has to be an even number of the largest far field cells, so round the cells up until it is
+		const int multiple = 2 << (FAR_LEVELS - 1);
+		int cells = multiple * std::max(1, (int)(WORLD_SIZE / (cellSize * multiple)));
+		cellSize = WORLD_SIZE / cells;
+	}
+	stencil = buildStencil();
+}
+
+void autotuneCellSize(double seconds){
+	static int step = AUTOTUNE_INTERVAL; // start with a round
+	static int trial = 0; // cell divisions being measured, 0 when not tuning
+	if(deterministicMode){
+		// the step time depends on the machine and the number of threads, so the cells do not come from it
+		if(cellDivisions != DETERMINISTIC_CELL_DIVISIONS){
+			setGridParameters(boidScope, DETERMINISTIC_CELL_DIVISIONS);
+		}
+		step = AUTOTUNE_INTERVAL; // a new round once it is turned off again
+		trial = 0;
+		return;
+	}
+	if(!autotuneCells){
+		return;
+	}
+	step++;
+	if(trial == 0){
+		if(step >= AUTOTUNE_INTERVAL){
+			step = 0;
+			trial = 1;
+			setGridParameters(boidScope, trial);
+		}
+		return;
+	}
+
+	if(step > 1){ // the first step with new cells also pays for moving the bricks around
+		CellSizeTrial& t = cellSizeTrials[trial];
+		if(step == 2){
+			t = CellSizeTrial();
+		}
+		t.seconds += seconds / (AUTOTUNE_STEPS - 1);
+		if(neighbourStats.queries > 0){
+			t.candidatesPerQuery += (float)neighbourStats.candidates / neighbourStats.queries / (AUTOTUNE_STEPS - 1);
+		}
+		if(neighbourStats.candidates > 0){
+			t.hitRate += (float)neighbourStats.found / neighbourStats.candidates / (AUTOTUNE_STEPS - 1);
+		}
+	}
+	if(step < AUTOTUNE_STEPS){
+		return;
+	}
+
+	step = 0;
+	if(trial < MAX_CELL_DIVISIONS){
+		trial++;
+		setGridParameters(boidScope, trial);
+		return;
+	}
+	int best = 1;
+	for(int d = 2; d <= MAX_CELL_DIVISIONS; d++){
+		if(cellSizeTrials[d].seconds < cellSizeTrials[best].seconds){
+			best = d;
+		}
 	}
-	return neighbours;
+	trial = 0;
+	setGridParameters(boidScope, best);
 }
\ No newline at end of file
@@ -2,14 +2,114 @@
 #define spatial_hash_hpp 
 
 #include <iostream>
+#include <cstdint>
 #include "boid.h"
 
-void putInHashTable(Boid& b);
+// Marks the end of a cell's list of boids
+const uint32_t NO_BOID = 0xFFFFFFFF;
+
+// How far a boid can see, and how many grid cells that distance is split into
+extern float boidScope;
+extern int cellDivisions;
+extern float cellSize;
+const int MAX_CELL_DIVISIONS = 3;
+const int DETERMINISTIC_CELL_DIVISIONS = 2; // the cells used in deterministicMode
+// Only call this when the hash table is empty, i.e. between clearHashTable and the next putInHashTable
+void setGridParameters(float scope, int divisions);
+
+// Picks the cell size that gives the fastest steps. Call it once per step, after clearHashTable, with the time
+// spent on the hash table and steering that step. The cell size changes the far field and the order neighbours are
+// found in, so in deterministicMode it is not tuned but pinned to scope/DETERMINISTIC_CELL_DIVISIONS
+struct CellSizeTrial {
+	double seconds;
+	float candidatesPerQuery, hitRate;
+	CellSizeTrial() : seconds(0.0), candidatesPerQuery(0.0f), hitRate(0.0f) {}
+};
+extern bool autotuneCells;
+extern CellSizeTrial cellSizeTrials[MAX_CELL_DIVISIONS + 1]; // measured per number of cell divisions
+void autotuneCellSize(double seconds);
+
+void putInHashTable(uint32_t i);
+void packHashTable();
 void clearHashTable();
-std::vector<Boid*> getNeighbours(Boid& b);
-inline bool validNeighbour(Boid& a, Boid& b);
+extern float fieldOfView;
+
+// At most maxNeighbours (0 = no limit) are returned, the closest ones if closestNeighbours is set, otherwise the
+// first found. neighbourStats counts the queries of the current step, how many of them had to be cut, and how many
+// boids were tested and found
+struct NeighbourStats {
+	uint32_t queries, truncated;
+	uint64_t candidates, found;
+	NeighbourStats() : queries(0), truncated(0), candidates(0), found(0) {}
+	void add(const NeighbourStats& o) { queries += o.queries; truncated += o.truncated; candidates += o.candidates; found += o.found; }
+};
+extern int maxNeighbours;
+extern bool closestNeighbours;
+extern NeighbourStats neighbourStats;
+// Where the calling thread counts its queries, neighbourStats unless a worker thread points it at its own
+extern thread_local NeighbourStats* threadNeighbourStats;
+
+// A copy of the boids in and around one grid cell (the whole stencil), so that the neighbours of every boid in the
+// centre cell can be found without going back to the grid. The centre cell's boids are the first centreCount slots.
+// In a periodic world positions are moved across the seam, so offsets between slots never need wrapOffset
+struct NeighbourTile {
+	// The slots from begin to end came from the stencil cell i, j, k cells away from the centre cell, or if single is
+	// false from a run of cells with few boids each, which are always scanned together
+	struct Cell {
+		int i, j, k;
+		uint32_t begin, end;
+		bool single;
+	};
+	std::vector<float> x, y, z, vx, vy, vz;
+	std::vector<uint32_t> index; // boid index of each slot
+	std::vector<uint32_t> slot; // 0, 1, 2, ...
+	std::vector<Cell> cells; // the stencil cells that have boids of the species, in stencil order
+	glm::vec3 origin; // lowest corner of the centre cell
+	uint32_t size, centreCount;
+	NeighbourTile() : origin(0.0f), size(0), centreCount(0) {}
+};
+// Number of non-empty cells, valid after packHashTable
+uint32_t getNrCells();
+// Only boids of the given species are copied, so the tile is empty if the centre cell has none of them
+void loadTile(uint32_t cell, int species, NeighbourTile& tile);
+// Fills neighbours with the tile slots of all boids within sight of the boid in the given slot. Cells out of its reach
+// or behind it are skipped without looking at their boids
+void getTileNeighbours(const NeighbourTile& tile, uint32_t slot, std::vector<uint32_t>& neighbours);
+
+// All boids of a species in the cells that overlap the box from lo to hi, for looking further than boidScope for
+// boids of another kind. The caller has to check the distances. Cells are wrapped in a periodic world.
+// packHashTable indexes where each species is on a coarser grid, so only cells with boids of the species are visited
+void getSpeciesInBox(const glm::vec3& lo, const glm::vec3& hi, int species, std::vector<uint32_t>& candidates);
+
+// Boids of the same species seen beyond the normal scope when useFarField is on, summed up (partly through whole cells)
+struct FarField {
+	float count;
+	glm::vec3 positionSum, velocitySum;
+	FarField() : count(0.0f), positionSum(0.0f), velocitySum(0.0f) {}
+};
+// positionSum is measured across the seam in a periodic world, like the offsets from wrapOffset
+FarField getFarField(uint32_t index);
+extern bool useFarField;
+
+extern bool periodicWorld;
+extern const float WORLD_SIZE;
+
+// Moves a position that has left a periodic world back in on the opposite side
+inline glm::vec3 wrapPosition(glm::vec3 p){
+	if(!periodicWorld){
+		return p;
+	}
+	return p - WORLD_SIZE*glm::floor(p*(1.0f/WORLD_SIZE) + 0.5f);
+}
+
+// Shortest offset between two positions, which in a periodic world may go across the seam
+inline glm::vec3 wrapOffset(glm::vec3 d){
+	if(!periodicWorld){
+		return d;
+	}
+	return d - WORLD_SIZE*glm::floor(d*(1.0f/WORLD_SIZE) + 0.5f);
+}
 
-extern const int nrBoids;
 extern std::vector<Boid> boids;
 
 #endif
\ No newline at end of file
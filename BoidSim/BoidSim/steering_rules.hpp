@@ -0,0 +1,202 @@
+#ifndef steering_rules_hpp
+#define steering_rules_hpp
+
+#include <array>
+#include <cmath>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include "flock.hpp"
+#include "distance_field.hpp"
+#include "obstacle_index.hpp"
+#include "flow_field.hpp"
+#include "fast_math.hpp"
+
+// Steering rules as policies: a rule is a struct with a static apply that returns its weighted force. A kernel adds up
+// the forces of a list of rules and limits the result, so a rule left out of the list costs nothing at all.
+// To add a rule, write such a struct and put it in FlockingRules (always on) or give it a bit in OptionalRule
+
+const float MIN_WALL_DISTANCE = 0.1f; // keeps the wall force finite, also pushes boids that got through a wall back in
+
+//Flocking rules, boids in the far field only affect alignment and cohesion
+struct Alignment {
+	static glm::vec3 apply(const Boid& b, const FlockSums& sums, const SteeringParameters& p) {
+		glm::vec3 alignment(0.0f);
+		if (sums.count > 0) {
+			alignment = safeNormalize(sums.velocitySum * (1.0f / sums.count) - b.velocity);
+		}
+		return p.alignment*alignment;
+	}
+};
+
+struct Cohesion {
+	static glm::vec3 apply(const Boid& b, const FlockSums& sums, const SteeringParameters& p) {
+		glm::vec3 cohesion(0.0f);
+		if (sums.count > 0) {
+			cohesion = safeNormalize(sums.positionSum * (1.0f / sums.count) - b.position - b.velocity);
+		}
+		return p.cohesion*cohesion;
+	}
+};
+
+struct Separation {
+	static glm::vec3 apply(const Boid& b, const FlockSums& sums, const SteeringParameters& p) {
+		glm::vec3 separation(0.0f);
+		if (sums.nearCount > 0) {
+			separation = safeNormalize(sums.separationSum * (1.0f / sums.nearCount) - b.velocity);
+		}
+		return p.separation*separation;
+	}
+};
+
+//Avoid planes, the closest one as found in the baked distance field
+struct PlaneAvoid {
+	static glm::vec3 apply(const Boid& b, const FlockSums&, const SteeringParameters& p) {
+		glm::vec3 planeforce(0.0f);
+		float wallDistance;
+		glm::vec3 awayFromWall;
+		if (sampleDistanceField(b.position, wallDistance, awayFromWall)) {
+			planeforce = awayFromWall * (p.softness / std::max(wallDistance, MIN_WALL_DISTANCE)) - (float)std::size(walls) * b.velocity;
+		}
+		return p.plane*planeforce;
+	}
+};
+
+//Avoid/steer towards the obstaclepoints that reach this boid
+struct PointForce {
+	static glm::vec3 apply(const Boid& b, const FlockSums&, const SteeringParameters& p) {
+		glm::vec3 pointforce(0.0f);
+		uint32_t nrPoints = getObstacleForce(b.position, pointforce);
+		if (nrPoints > 0) {
+			pointforce = safeNormalize(pointforce * (1.0f / nrPoints) - b.velocity);
+		}
+		return p.point*pointforce;
+	}
+};
+
+//Avoid the mesh ahead, if the boid is heading for one
+struct MeshAvoid {
+	static glm::vec3 apply(const Boid& b, const FlockSums& sums, const SteeringParameters& p) {
+		glm::vec3 meshforce(0.0f);
+		if (sums.meshDistance < LOOK_AHEAD) {
+			meshforce = sums.meshNormal * (p.softness / std::max(sums.meshDistance, MIN_WALL_DISTANCE)) - b.velocity;
+		}
+		return p.mesh*meshforce;
+	}
+};
+
+//Follow the shortest path to a goal
+struct FlowFollow {
+	static glm::vec3 apply(const Boid& b, const FlockSums&, const SteeringParameters& p) {
+		glm::vec3 flowforce(0.0f);
+		glm::vec3 flowDirection;
+		if (sampleFlowField(b.position, flowDirection)) {
+			flowforce = flowDirection - b.velocity * (1.0f / p.maxSpeed);
+		}
+		return p.flow*flowforce;
+	}
+};
+
+//Flee from predators, chase prey
+struct Flee {
+	static glm::vec3 apply(const Boid&, const FlockSums& sums, const SteeringParameters& p) {
+		glm::vec3 fleeforce(0.0f);
+		if (sums.fleeSum != glm::vec3(0.0f)) {
+			fleeforce = safeNormalize(sums.fleeSum);
+		}
+		return p.flee*fleeforce;
+	}
+};
+
+struct Chase {
+	static glm::vec3 apply(const Boid& b, const FlockSums& sums, const SteeringParameters& p) {
+		glm::vec3 chaseforce(0.0f);
+		if (sums.chasing) {
+			chaseforce = safeNormalize(sums.preyOffset - b.velocity);
+		}
+		return p.chase*chaseforce;
+	}
+};
+
+//Avoid player controlled line
+struct LineRepel {
+	static glm::vec3 apply(const Boid& b, const FlockSums&, const SteeringParameters& p) {
+		glm::vec3 lineforce(0.0f);
+		if (repellLine) {
+			glm::vec3 point = cameraPos + dot(b.position - cameraPos, cameraDir) / dot(cameraDir, cameraDir) * (cameraDir);
+			glm::vec3 away = b.position - point;
+			float away2 = glm::dot(away, away);
+			if (away2 > 0.0f) {
+				// normalize(away)/|away| is away/|away|^2, no square root needed
+				lineforce = (fastMath ? away * (p.softness * p.softness / away2) : normalize(away) * (p.softness * p.softness) / glm::length(away)) - b.velocity;
+			}
+		}
+		return p.line*lineforce;
+	}
+};
+
+// Adds up the rules in order, in one accumulator, and limits the acceleration
+template <class... Rules>
+glm::vec3 steerWith(const Boid& b, const FlockSums& sums, const SteeringParameters& p) {
+	glm::vec3 steering = (... + Rules::apply(b, sums, p));
+
+	// Limit acceleration
+	float length2 = glm::dot(steering, steering);
+	if (!(length2 > 0.0f)) {
+		return glm::vec3(0.0f);
+	}
+	if (fastMath) {
+		float inverse = inverseSqrt(length2);
+		return steering * (std::min(length2 * inverse, p.maxAcceleration) * inverse);
+	}
+	float magnitude = glm::clamp(glm::length(steering), 0.0f, p.maxAcceleration);
+	return magnitude*glm::normalize(steering);
+}
+
+// Rules that can be left out of a kernel when a scene does not need them, one bit each in a kernel's mask
+enum OptionalRule {
+	WALL_RULES = 1,
+	POINT_RULES = 2,
+	MESH_RULES = 4,
+	FLOW_RULES = 8,
+	SPECIES_RULES = 16,
+	LINE_RULES = 32,
+	ALL_RULES = 63
+};
+
+template <class Rule, unsigned Mask, unsigned Bit>
+using KeepRule = typename std::conditional<(Mask & Bit) != 0, std::tuple<Rule>, std::tuple<>>::type;
+
+// The rules of the kernel for a mask, in the order they are added up
+template <unsigned Mask>
+using KernelRules = decltype(std::tuple_cat(
+	std::tuple<Alignment, Cohesion, Separation>(),
+	KeepRule<PlaneAvoid, Mask, WALL_RULES>(),
+	KeepRule<PointForce, Mask, POINT_RULES>(),
+	KeepRule<MeshAvoid, Mask, MESH_RULES>(),
+	KeepRule<FlowFollow, Mask, FLOW_RULES>(),
+	KeepRule<Flee, Mask, SPECIES_RULES>(),
+	KeepRule<Chase, Mask, SPECIES_RULES>(),
+	KeepRule<LineRepel, Mask, LINE_RULES>()));
+
+template <class RuleTuple>
+struct Kernel;
+
+template <class... Rules>
+struct Kernel<std::tuple<Rules...>> {
+	static glm::vec3 steer(const Boid& b, const FlockSums& sums, const SteeringParameters& p) {
+		return steerWith<Rules...>(b, sums, p);
+	}
+};
+
+template <size_t... Masks>
+std::array<SteeringKernel, sizeof...(Masks)> makeKernels(std::index_sequence<Masks...>) {
+	return { { &Kernel<KernelRules<(unsigned)Masks>>::steer... } };
+}
+
+// One kernel for every combination of optional rules, indexed by mask
+const std::array<SteeringKernel, ALL_RULES + 1> steeringKernels = makeKernels(std::make_index_sequence<ALL_RULES + 1>());
+
+#endif
@@ -0,0 +1,149 @@
+#include "wind_field.hpp"
+#include "spatial_hash.hpp"
+#include <cmath>
+#include <cstddef>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+const int WIND_CELLS = 16; // grid points along each axis, a power of two so indices can wrap with a mask
+const int NOISE_CELLS = 4; // random values along each axis of the noise, fewer means larger swirls
+const float WIND_CHANGE = 0.002f; // how far the noise moves in time per unit of time, in noise cells
+
+bool useWind = false;
+float windStrength = 0.02f;
+
+float windTime = 0.0f;
+std::vector<float> windX(WIND_CELLS * WIND_CELLS * WIND_CELLS), windY(windX.size()), windZ(windX.size());
+
+// random value in [-1, 1] for a corner of the noise lattice
+float getNoiseValue(int x, int y, int z, int t, int component) {
+	uint32_t h = (uint32_t)(x & (NOISE_CELLS - 1)) | (uint32_t)(y & (NOISE_CELLS - 1)) << 8 | (uint32_t)(z & (NOISE_CELLS - 1)) << 16 | (uint32_t)component << 24;
+	h ^= (uint32_t)t * 0x9E3779B9u;
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return h * (2.0f / 4294967295.0f) - 1.0f;
+}
+
+float smooth(float t) {
+	return t * t * (3.0f - 2.0f * t);
+}
+
+// one component of the potential at a point given in noise cells, smoothly interpolated in space and time
+float getPotential(glm::vec3 p, int component) {
+	glm::vec3 f = glm::floor(p);
+	int x = (int)f.x, y = (int)f.y, z = (int)f.z, t = (int)std::floor(windTime);
+	glm::vec3 s(smooth(p.x - f.x), smooth(p.y - f.y), smooth(p.z - f.z));
+	float st = smooth(windTime - t);
+	float value = 0.0f;
+	for (int c = 0; c < 16; c++) {
+		int dx = c & 1, dy = (c >> 1) & 1, dz = (c >> 2) & 1, dt = (c >> 3) & 1;
+		float w = (dx ? s.x : 1.0f - s.x) * (dy ? s.y : 1.0f - s.y) * (dz ? s.z : 1.0f - s.z) * (dt ? st : 1.0f - st);
+		value += w * getNoiseValue(x + dx, y + dy, z + dz, t + dt, component);
+	}
+	return value;
+}
+
+int getWindIndex(int x, int y, int z) {
+	const int mask = WIND_CELLS - 1;
+	return ((z & mask) * WIND_CELLS + (y & mask)) * WIND_CELLS + (x & mask);
+}
+
+void updateWind(float dt) {
+	windTime += WIND_CHANGE * dt;
+
+	static std::vector<glm::vec3> potential(windX.size());
+	for (int z = 0; z < WIND_CELLS; z++)
+		for (int y = 0; y < WIND_CELLS; y++)
+			for (int x = 0; x < WIND_CELLS; x++) {
+				glm::vec3 p = glm::vec3(x, y, z) * ((float)NOISE_CELLS / WIND_CELLS);
+				potential[getWindIndex(x, y, z)] = glm::vec3(getPotential(p, 0), getPotential(p, 1), getPotential(p, 2));
+			}
+
+	// curl by central differences, then scaled so the typical length is 1
+	float sum2 = 0.0f;
+	for (int z = 0; z < WIND_CELLS; z++)
+		for (int y = 0; y < WIND_CELLS; y++)
+			for (int x = 0; x < WIND_CELLS; x++) {
+				glm::vec3 dx = potential[getWindIndex(x + 1, y, z)] - potential[getWindIndex(x - 1, y, z)];
+				glm::vec3 dy = potential[getWindIndex(x, y + 1, z)] - potential[getWindIndex(x, y - 1, z)];
+				glm::vec3 dz = potential[getWindIndex(x, y, z + 1)] - potential[getWindIndex(x, y, z - 1)];
+				int i = getWindIndex(x, y, z);
+				windX[i] = dy.z - dz.y;
+				windY[i] = dz.x - dx.z;
+				windZ[i] = dx.y - dy.x;
+				sum2 += windX[i] * windX[i] + windY[i] * windY[i] + windZ[i] * windZ[i];
+			}
+	float scale = sum2 > 0.0f ? 1.0f / std::sqrt(sum2 / windX.size()) : 0.0f;
+	for (size_t i = 0; i < windX.size(); i++) {
+		windX[i] *= scale;
+		windY[i] *= scale;
+		windZ[i] *= scale;
+	}
+}
+
+void sampleWind(std::vector<glm::vec3>& wind) {
+	wind.resize(boids.size());
+	const float toGrid = WIND_CELLS / WORLD_SIZE;
+	size_t i = 0;
+
+#if defined(__AVX2__)
+	static_assert(sizeof(Boid) % sizeof(float) == 0, "boids are gathered as floats");
+	const int floatsPerBoid = sizeof(Boid) / sizeof(float);
+	const __m256i boidOffsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(floatsPerBoid));
+	const __m256i mask = _mm256_set1_epi32(WIND_CELLS - 1);
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256 scale = _mm256_set1_ps(toGrid);
+	const __m256 ones = _mm256_set1_ps(1.0f);
+	for (; i + 8 <= boids.size(); i += 8) {
+		const float* position = reinterpret_cast<const float*>(&boids[i].position);
+		__m256i cell[3][2];
+		__m256 weight[3][2];
+		for (int a = 0; a < 3; a++) {
+			__m256 g = _mm256_mul_ps(_mm256_i32gather_ps(position + a, boidOffsets, 4), scale);
+			__m256 f = _mm256_floor_ps(g);
+			__m256i c = _mm256_cvttps_epi32(f);
+			cell[a][0] = _mm256_and_si256(c, mask);
+			cell[a][1] = _mm256_and_si256(_mm256_add_epi32(c, one), mask);
+			weight[a][1] = _mm256_sub_ps(g, f);
+			weight[a][0] = _mm256_sub_ps(ones, weight[a][1]);
+		}
+		__m256 wx = _mm256_setzero_ps(), wy = _mm256_setzero_ps(), wz = _mm256_setzero_ps();
+		for (int c = 0; c < 8; c++) {
+			int dx = c & 1, dy = (c >> 1) & 1, dz = (c >> 2) & 1;
+			__m256i index = _mm256_add_epi32(_mm256_slli_epi32(_mm256_add_epi32(_mm256_slli_epi32(cell[2][dz], 4), cell[1][dy]), 4), cell[0][dx]);
+			__m256 w = _mm256_mul_ps(_mm256_mul_ps(weight[0][dx], weight[1][dy]), weight[2][dz]);
+			wx = _mm256_add_ps(wx, _mm256_mul_ps(w, _mm256_i32gather_ps(windX.data(), index, 4)));
+			wy = _mm256_add_ps(wy, _mm256_mul_ps(w, _mm256_i32gather_ps(windY.data(), index, 4)));
+			wz = _mm256_add_ps(wz, _mm256_mul_ps(w, _mm256_i32gather_ps(windZ.data(), index, 4)));
+		}
+		float x[8], y[8], z[8];
+		_mm256_storeu_ps(x, _mm256_mul_ps(wx, _mm256_set1_ps(windStrength)));
+		_mm256_storeu_ps(y, _mm256_mul_ps(wy, _mm256_set1_ps(windStrength)));
+		_mm256_storeu_ps(z, _mm256_mul_ps(wz, _mm256_set1_ps(windStrength)));
+		for (int l = 0; l < 8; l++) {
+			wind[i + l] = glm::vec3(x[l], y[l], z[l]);
+		}
+	}
+	static_assert(WIND_CELLS == 16, "the AVX2 path computes indices with shifts by 4");
+#endif
+
+	for (; i < boids.size(); i++) {
+		glm::vec3 g = boids[i].position * toGrid;
+		glm::vec3 f = glm::floor(g);
+		glm::vec3 t = g - f;
+		int x = (int)f.x, y = (int)f.y, z = (int)f.z;
+		glm::vec3 w(0.0f);
+		for (int c = 0; c < 8; c++) {
+			int dx = c & 1, dy = (c >> 1) & 1, dz = (c >> 2) & 1;
+			float weight = (dx ? t.x : 1.0f - t.x) * (dy ? t.y : 1.0f - t.y) * (dz ? t.z : 1.0f - t.z);
+			int index = getWindIndex(x + dx, y + dy, z + dz);
+			w += weight * glm::vec3(windX[index], windY[index], windZ[index]);
+		}
+		wind[i] = w * windStrength;
+	}
+}
@@ -0,0 +1,17 @@
+#ifndef wind_field_hpp
+#define wind_field_hpp
+
+#include <vector>
+#include <glm/glm.hpp>
+
+// Wind that changes smoothly over space and time: the curl of a noise field, so it swirls without sources or sinks.
+// Kept on a coarse grid that repeats every WORLD_SIZE, which also makes it seamless in a periodic world
+extern bool useWind;
+extern float windStrength; // typical length of the wind added to a boid's velocity per unit of time
+
+// Advances the noise by dt and recomputes the grid
+void updateWind(float dt);
+// Wind at every boid, interpolated from the grid. Done for 8 boids at a time when AVX2 is available
+void sampleWind(std::vector<glm::vec3>& wind);
+
+#endif